@@ -1,4 +1,11 @@
 #include <algorithm>
+#include <cerrno>
+#include <csetjmp>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <fstream>
 #include <iostream>
 #include <map>
@@ -8,10 +15,173 @@
 #include <string>
 #include <vector>
 
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 struct ExecutionContext {
   std::vector<size_t> instruction_counts;
-  std::map<size_t, size_t> loop_counts;
-  bool profiler_enabled;
+  std::vector<size_t> loop_counts; // Indexed by Loop::index
+};
+
+// Compact opcodes executed by the dispatch loop in run()
+enum class OpCode : uint8_t {
+  Add,       // Adds value to the cell at offset
+  Move,      // Moves the data pointer by offset
+  Output,    // Writes the cell at offset
+  Input,     // Reads into the cell at offset
+  MulAdd,    // Adds value times the current cell to the cell at offset
+  Clear,     // Zeroes the current cell; ends a loop run in closed form
+  Scan,      // Moves the data pointer by offset until it reaches a zero cell
+  NativeLoop, // LoopStart of a loop the JIT has compiled to machine code
+  LoopStart, // Jumps past the matching LoopEnd if the current cell is zero
+  LoopEnd,   // Jumps back to the loop body if the current cell is non-zero
+  Halt
+};
+
+struct ByteCode {
+  OpCode code;
+  uint8_t value; // Amount for Add, factor for MulAdd, loop step for Clear
+  // Cell offset for Add/Output/Input/MulAdd, distance for Move, stride for
+  // Scan
+  int32_t offset;
+  uint32_t jump; // Target index for LoopStart/LoopEnd
+  uint32_t loop; // Loop::index of the source loop for LoopStart/LoopEnd/
+                 // Clear/Scan
+  // First instruction ID this opcode accounts for. An opcode stands for all
+  // instructions up to the next opcode's id, which all run exactly as often
+  // as it does.
+  uint32_t id;
+};
+
+// Canonicalizes the instruction stream while it is being flattened. Runs of
+// '+'/'-' on one cell fold into a single Add, and pointer movement is
+// deferred and turned into cell offsets until a loop boundary needs the data
+// pointer to be up to date.
+class ProgramBuilder {
+public:
+  std::vector<ByteCode> program;
+
+  void movePointer(int delta, size_t id) {
+    offset += delta;
+    consume(id);
+  }
+
+  void addToCell(int delta, size_t id) {
+    if (has_add && add_offset != offset) {
+      flushAdd();
+    }
+    if (!has_add) {
+      has_add = true;
+      add_offset = offset;
+      add_value = 0;
+    }
+    add_value += delta;
+    consume(id);
+  }
+
+  void output(size_t id) {
+    flushAdd();
+    consume(id);
+    emit(OpCode::Output, offset);
+  }
+
+  void input(size_t id) {
+    flushAdd();
+    consume(id);
+    emit(OpCode::Input, offset);
+  }
+
+  size_t loopStart(size_t id, size_t index) {
+    flushPointer();
+    consume(id);
+    size_t start = program.size();
+    emit(OpCode::LoopStart, 0);
+    program[start].loop = static_cast<uint32_t>(index);
+    return start;
+  }
+
+  void loopEnd(size_t start) {
+    flushPointer();
+    size_t end = program.size();
+    emit(OpCode::LoopEnd, 0);
+    program[end].loop = program[start].loop;
+    program[start].jump = static_cast<uint32_t>(end + 1);
+    program[end].jump = static_cast<uint32_t>(start + 1);
+  }
+
+  // Replaces a simple loop, which moves the current cell by step each
+  // iteration, with its closed form: -step * p[0] iterations add
+  // -step * change * p[0] to every other cell, then p[0] ends up zero.
+  // last_id is the ID of the last instruction in the loop body.
+  void closedFormLoop(size_t index, const std::map<int, int> &cell_changes,
+                      size_t last_id) {
+    flushPointer();
+    int step = cell_changes.at(0);
+    for (const auto &change : cell_changes) {
+      int factor = -step * change.second;
+      if (change.first != 0 && (factor & 0xFF) != 0) {
+        emit(OpCode::MulAdd, change.first, static_cast<uint8_t>(factor));
+      }
+    }
+    consume(last_id);
+    emit(OpCode::Clear, 0, static_cast<uint8_t>(step));
+    program.back().loop = static_cast<uint32_t>(index);
+  }
+
+  // Replaces a loop whose body only moves the data pointer, by stride in
+  // total, with a search for the next zero cell
+  void scanLoop(size_t index, int stride, size_t last_id) {
+    flushPointer();
+    consume(last_id);
+    emit(OpCode::Scan, stride);
+    program.back().loop = static_cast<uint32_t>(index);
+  }
+
+  void halt() {
+    flushPointer();
+    emit(OpCode::Halt, 0);
+  }
+
+private:
+  int offset = 0; // Pointer movement not yet applied
+  bool has_add = false;
+  int add_offset = 0;
+  int add_value = 0;
+  uint32_t next_id = 0;     // First instruction ID not owned by an opcode
+  uint32_t consumed_id = 0; // One past the last instruction compiled
+
+  void consume(size_t id) { consumed_id = static_cast<uint32_t>(id + 1); }
+
+  void emit(OpCode code, int32_t op_offset, uint8_t value = 0) {
+    ByteCode op;
+    op.code = code;
+    op.value = value;
+    op.offset = op_offset;
+    op.jump = 0;
+    op.loop = 0;
+    op.id = next_id;
+    program.push_back(op);
+    next_id = consumed_id;
+  }
+
+  void flushAdd() {
+    if (has_add && (add_value & 0xFF) != 0) {
+      emit(OpCode::Add, add_offset, static_cast<uint8_t>(add_value));
+    }
+    has_add = false;
+  }
+
+  void flushPointer() {
+    flushAdd();
+    if (offset != 0) {
+      emit(OpCode::Move, offset);
+      offset = 0;
+    }
+  }
 };
 
 class Instruction {
@@ -19,108 +189,93 @@ public:
   size_t id; // Unique ID for the instruction
   char cmd;  // The code character
   virtual ~Instruction() = default;
-  virtual void execute(std::vector<uint8_t> &data, size_t &data_ptr,
-                       std::istream &input, std::ostream &output,
-                       ExecutionContext &context) = 0;
+  virtual void compile(ProgramBuilder &builder) const = 0;
 };
 
 class IncrementDataPointer : public Instruction {
 public:
-  void execute(std::vector<uint8_t> &data, size_t &data_ptr, std::istream &,
-               std::ostream &, ExecutionContext &context) override {
-    if (context.profiler_enabled) {
-      context.instruction_counts[id]++;
-    }
-    ++data_ptr;
-    if (data_ptr >= data.size()) {
-      data.push_back(0);
-    }
+  void compile(ProgramBuilder &builder) const override {
+    builder.movePointer(1, id);
   }
 };
 
 class DecrementDataPointer : public Instruction {
 public:
-  void execute(std::vector<uint8_t> &data, size_t &data_ptr, std::istream &,
-               std::ostream &, ExecutionContext &context) override {
-    if (context.profiler_enabled) {
-      context.instruction_counts[id]++;
-    }
-    if (data_ptr == 0) {
-      throw std::runtime_error("Data pointer moved before the start of data.");
-    }
-    --data_ptr;
+  void compile(ProgramBuilder &builder) const override {
+    builder.movePointer(-1, id);
   }
 };
 
 class IncrementByte : public Instruction {
 public:
-  void execute(std::vector<uint8_t> &data, size_t &data_ptr, std::istream &,
-               std::ostream &, ExecutionContext &context) override {
-    if (context.profiler_enabled) {
-      context.instruction_counts[id]++;
-    }
-    ++data[data_ptr];
+  void compile(ProgramBuilder &builder) const override {
+    builder.addToCell(1, id);
   }
 };
 
 class DecrementByte : public Instruction {
 public:
-  void execute(std::vector<uint8_t> &data, size_t &data_ptr, std::istream &,
-               std::ostream &, ExecutionContext &context) override {
-    if (context.profiler_enabled) {
-      context.instruction_counts[id]++;
-    }
-    --data[data_ptr];
+  void compile(ProgramBuilder &builder) const override {
+    builder.addToCell(-1, id);
   }
 };
 
 class OutputByte : public Instruction {
 public:
-  void execute(std::vector<uint8_t> &data, size_t &data_ptr, std::istream &,
-               std::ostream &output, ExecutionContext &context) override {
-    if (context.profiler_enabled) {
-      context.instruction_counts[id]++;
-    }
-    output.put(static_cast<char>(data[data_ptr]));
-  }
+  void compile(ProgramBuilder &builder) const override { builder.output(id); }
 };
 
 class InputByte : public Instruction {
 public:
-  void execute(std::vector<uint8_t> &data, size_t &data_ptr,
-               std::istream &input, std::ostream &,
-               ExecutionContext &context) override {
-    if (context.profiler_enabled) {
-      context.instruction_counts[id]++;
-    }
-    int ch = input.get();
-    data[data_ptr] = (ch == EOF) ? 0 : static_cast<uint8_t>(ch);
-  }
+  void compile(ProgramBuilder &builder) const override { builder.input(id); }
 };
 
 class Loop : public Instruction {
 public:
   std::vector<std::unique_ptr<Instruction>> instructions;
+  size_t index; // Position among all loops, in parse order
   bool is_simple;
   bool is_innermost;
+  std::map<int, int> cell_changes; // Net change per cell offset, if simple
+  int scan_stride = 0; // Net pointer movement, if the body only moves it
 
-  void execute(std::vector<uint8_t> &data, size_t &data_ptr,
-               std::istream &input, std::ostream &output,
-               ExecutionContext &context) override {
-    if (context.profiler_enabled) {
-      context.instruction_counts[id]++;
+  void compile(ProgramBuilder &builder) const override {
+    if (is_simple) {
+      builder.closedFormLoop(index, cell_changes, id + instructions.size());
+      return;
     }
-    while (data[data_ptr] != 0) {
-      if (context.profiler_enabled) {
-        context.loop_counts[id]++;
-      }
-      for (const auto &instr : instructions) {
-        instr->execute(data, data_ptr, input, output, context);
-      }
+    if (scan_stride != 0) {
+      builder.scanLoop(index, scan_stride, id + instructions.size());
+      return;
     }
+    size_t start = builder.loopStart(id, index);
+    for (const auto &instr : instructions) {
+      instr->compile(builder);
+    }
+    builder.loopEnd(start);
   }
 };
 
+// Net change of each cell, keyed by offset from the data pointer at the
+// start of the loop body
+std::map<int, int>
+getCellChanges(const std::vector<std::unique_ptr<Instruction>> &instructions) {
+  int data_ptr_change = 0;
+  std::map<int, int> cell_changes;
+  for (const auto &instr : instructions) {
+    if (dynamic_cast<IncrementDataPointer *>(instr.get())) {
+      data_ptr_change++;
+    } else if (dynamic_cast<DecrementDataPointer *>(instr.get())) {
+      data_ptr_change--;
+    } else if (dynamic_cast<IncrementByte *>(instr.get())) {
+      cell_changes[data_ptr_change]++;
+    } else if (dynamic_cast<DecrementByte *>(instr.get())) {
+      cell_changes[data_ptr_change]--;
+    }
+  }
+  return cell_changes;
+}
+
 bool isLoopSimple(
     const std::vector<std::unique_ptr<Instruction>> &instructions) {
   // Check if any instruction is a Loop
@@ -150,14 +305,7 @@ bool isLoopSimple(
     return false;
   }
   // Compute net change to p[0] per iteration
-  int p0_change = 0;
-  for (const auto &instr : instructions) {
-    if (dynamic_cast<IncrementByte *>(instr.get())) {
-      p0_change++;
-    } else if (dynamic_cast<DecrementByte *>(instr.get())) {
-      p0_change--;
-    }
-  }
+  int p0_change = getCellChanges(instructions)[0];
 
   if (p0_change != 1 && p0_change != -1) {
     return false;
@@ -165,6 +313,23 @@ bool isLoopSimple(
   return true;
 }
 
+// Returns the net pointer movement of a loop body made only of '>' and '<',
+// or 0 if the loop is not a memory scan
+int getScanStride(
+    const std::vector<std::unique_ptr<Instruction>> &instructions) {
+  int data_ptr_change = 0;
+  for (const auto &instr : instructions) {
+    if (dynamic_cast<IncrementDataPointer *>(instr.get())) {
+      data_ptr_change++;
+    } else if (dynamic_cast<DecrementDataPointer *>(instr.get())) {
+      data_ptr_change--;
+    } else {
+      return 0;
+    }
+  }
+  return data_ptr_change;
+}
+
 std::vector<std::unique_ptr<Instruction>>
 parse(const std::string &code, size_t &index, size_t &instruction_id,
       std::vector<char> &instruction_cmds, std::vector<Loop *> &loops,
@@ -231,12 +396,17 @@ parse(const std::string &code, size_t &index, size_t &instruction_id,
       loop->cmd = '[';
       loop->is_innermost = true;
       instruction_cmds.push_back('[');
+      loop->index = loops.size();
       loops.push_back(loop.get());
 
       loop->instructions = parse(code, index, instruction_id, instruction_cmds,
                                  loops, loop.get());
 
       loop->is_simple = isLoopSimple(loop->instructions);
+      if (loop->is_simple) {
+        loop->cell_changes = getCellChanges(loop->instructions);
+      }
+      loop->scan_stride = getScanStride(loop->instructions);
 
       instructions.push_back(std::move(loop));
       break;
@@ -251,8 +421,926 @@ parse(const std::string &code, size_t &index, size_t &instruction_id,
   return instructions;
 }
 
+// Flattens the parsed instruction tree into one contiguous program
+std::vector<ByteCode>
+compileProgram(const std::vector<std::unique_ptr<Instruction>> &instructions) {
+  ProgramBuilder builder;
+  for (const auto &instr : instructions) {
+    instr->compile(builder);
+  }
+  builder.halt();
+  if (builder.program.size() >= UINT32_MAX) {
+    throw std::runtime_error("Program too large.");
+  }
+  return std::move(builder.program);
+}
+
+// Buffered writer behind '.'. Bytes reach the kernel in large write(2)
+// calls: when the buffer fills, before input is read, at every newline in
+// line-buffered mode, and when the run ends.
+class OutputBuffer {
+public:
+  OutputBuffer(int fd, bool line_buffered)
+      : fd(fd), line_buffered(line_buffered), buffer(1 << 16), used(0) {}
+
+  ~OutputBuffer() { flush(); }
+
+  OutputBuffer(const OutputBuffer &) = delete;
+  OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+  void put(uint8_t byte) {
+    buffer[used++] = byte;
+    if (used == buffer.size() || (line_buffered && byte == '\n')) {
+      if (!flush()) {
+        throw std::runtime_error("Failed to write output.");
+      }
+    }
+  }
+
+  // Writes out everything buffered; returns false on a write error
+  bool flush() {
+    size_t written = 0;
+    while (written < used) {
+      ssize_t n = write(fd, buffer.data() + written, used - written);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        used = 0;
+        return false;
+      }
+      written += static_cast<size_t>(n);
+    }
+    used = 0;
+    return true;
+  }
+
+private:
+  int fd;
+  bool line_buffered;
+  std::vector<uint8_t> buffer;
+  size_t used;
+};
+
+// Buffered reader behind ','. Refills with one large read(2), flushing the
+// pending output first so prompts show up before the program blocks.
+class InputBuffer {
+public:
+  InputBuffer(int fd, OutputBuffer &output)
+      : fd(fd), output(output), buffer(1 << 16), next(0), filled(0) {}
+
+  // Returns the next byte, or EOF
+  int get() {
+    if (next == filled && !refill()) {
+      return EOF;
+    }
+    return buffer[next++];
+  }
+
+private:
+  int fd;
+  OutputBuffer &output;
+  std::vector<uint8_t> buffer;
+  size_t next;
+  size_t filled;
+
+  bool refill() {
+    if (!output.flush()) {
+      throw std::runtime_error("Failed to write output.");
+    }
+    ssize_t n;
+    do {
+      n = read(fd, buffer.data(), buffer.size());
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+      return false;
+    }
+    next = 0;
+    filled = static_cast<size_t>(n);
+    return true;
+  }
+};
+
+// Bytes of guard needed on each side of the tape. The data pointer is only
+// moved by Move right before a loop boundary reads the current cell, so no
+// opcode reaches further than one Move plus one cell offset past a cell that
+// has already been touched.
+size_t guardSize(const std::vector<ByteCode> &program) {
+  size_t max_move = 0;
+  size_t max_offset = 0;
+  for (const ByteCode &op : program) {
+    size_t distance = static_cast<size_t>(std::abs(op.offset));
+    if (op.code == OpCode::Move) {
+      max_move = std::max(max_move, distance);
+    } else if (op.code != OpCode::Scan) {
+      max_offset = std::max(max_offset, distance);
+    }
+  }
+  return max_move + max_offset + 1;
+}
+
+// Profiling policies for run(). The engine calls these hooks on every
+// opcode; NoProfiler's are empty, so the unprofiled engine carries no
+// profiling code at all.
+struct NoProfiler {
+  void countOpcode(const ByteCode *) {}
+  void countIteration(const ByteCode *) {}
+  void countClosedFormLoop(const ByteCode *, size_t) {}
+};
+
+// Counts opcode executions and loop iterations in dense arrays. Per
+// instruction counts are only derived from them once the run is over.
+class Profiler {
+public:
+  Profiler(const std::vector<ByteCode> &program,
+           const std::vector<Loop *> &loops)
+      : code(program.data()), opcode_counts(program.size(), 0),
+        iteration_counts(loops.size(), 0) {
+    for (Loop *loop : loops) {
+      loop_ids.push_back(loop->id);
+    }
+  }
+
+  void countOpcode(const ByteCode *pc) { opcode_counts[pc - code]++; }
+
+  void countIteration(const ByteCode *pc) { iteration_counts[pc->loop]++; }
+
+  // Credits a loop run in closed form with the iterations it would have made
+  void countClosedFormLoop(const ByteCode *pc, size_t iterations) {
+    opcode_counts[pc - code]++;
+    iteration_counts[pc->loop] += iterations;
+  }
+
+  // Expands the opcode counts back to the instructions they stand for. An
+  // opcode accounts for the instruction IDs up to the next opcode's id; a
+  // closed-form loop credits its body once per iteration instead.
+  void collect(const std::vector<ByteCode> &program,
+               ExecutionContext &context) const {
+    auto &counts = context.instruction_counts;
+    for (size_t i = 0; i < program.size(); ++i) {
+      const ByteCode &op = program[i];
+      size_t end = (i + 1 < program.size()) ? program[i + 1].id : counts.size();
+      size_t body = end;
+      if (op.code == OpCode::Clear || op.code == OpCode::Scan) {
+        body = loop_ids[op.loop] + 1;
+        for (size_t id = body; id < end; ++id) {
+          counts[id] += iteration_counts[op.loop];
+        }
+      }
+      for (size_t id = op.id; id < body; ++id) {
+        counts[id] += opcode_counts[i];
+      }
+    }
+    context.loop_counts = iteration_counts;
+  }
+
+private:
+  const ByteCode *code;
+  std::vector<size_t> opcode_counts;
+  std::vector<size_t> iteration_counts; // Indexed by Loop::index
+  std::vector<size_t> loop_ids;
+};
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BF_SCAN_SIMD 1
+#else
+#define BF_SCAN_SIMD 0
+#endif
+
+#if BF_SCAN_SIMD
+// Lane masks selecting every stride-th byte of a 32-byte block, starting at
+// lane 0 (forward scans) or lane 31 (backward scans)
+inline uint32_t forwardLanes(size_t stride) {
+  return stride == 1   ? 0xFFFFFFFFu
+         : stride == 2 ? 0x55555555u
+         : stride == 4 ? 0x11111111u
+                       : 0x01010101u;
+}
+
+inline uint32_t backwardLanes(size_t stride) {
+  return stride == 1   ? 0xFFFFFFFFu
+         : stride == 2 ? 0xAAAAAAAAu
+         : stride == 4 ? 0x88888888u
+                       : 0x80808080u;
+}
+
+// Bit i of the result is set if p[i] is zero, for 32 bytes at p
+inline uint32_t zeroMaskSSE2(const uint8_t *p) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16));
+  uint32_t lo_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(lo, zero));
+  uint32_t hi_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(hi, zero));
+  return lo_mask | (hi_mask << 16);
+}
+
+__attribute__((target("avx2"))) inline uint32_t
+zeroMaskAVX2(const uint8_t *p) {
+  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+}
+
+template <uint32_t (*ZeroMask)(const uint8_t *)>
+size_t scanForwardSIMD(const uint8_t *data, size_t size, size_t ptr,
+                       size_t stride) {
+  uint32_t lanes = forwardLanes(stride);
+  // Every block starts on the stride grid because 32 % stride == 0
+  for (; ptr + 32 <= size; ptr += 32) {
+    uint32_t mask = ZeroMask(data + ptr) & lanes;
+    if (mask != 0) {
+      return ptr + __builtin_ctz(mask);
+    }
+  }
+  for (; ptr < size; ptr += stride) {
+    if (data[ptr] == 0) {
+      return ptr;
+    }
+  }
+  return ptr;
+}
+
+template <uint32_t (*ZeroMask)(const uint8_t *)>
+size_t scanBackwardSIMD(const uint8_t *data, size_t ptr, size_t stride) {
+  uint32_t lanes = backwardLanes(stride);
+  for (; ptr >= 31; ptr -= 32) {
+    uint32_t mask = ZeroMask(data + ptr - 31) & lanes;
+    if (mask != 0) {
+      return ptr - 31 + (31 - __builtin_clz(mask));
+    }
+    // Stepping down would wrap past cell 0; the scalar tail finishes up
+    if (ptr < 32) {
+      break;
+    }
+  }
+  for (;; ptr -= stride) {
+    if (data[ptr] == 0) {
+      return ptr;
+    }
+    if (ptr < stride) {
+      return SIZE_MAX;
+    }
+  }
+}
+
+inline bool hasAVX2() {
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+}
+#endif
+
+// Returns the first index ptr + k * stride (k >= 0) holding a zero cell. The
+// tape reads as zero past its end, so the result may be >= size.
+size_t scanForward(const uint8_t *data, size_t size, size_t ptr,
+                   size_t stride) {
+  if (stride == 1) {
+    const void *zero = std::memchr(data + ptr, 0, size - ptr);
+    return zero ? static_cast<const uint8_t *>(zero) - data : size;
+  }
+#if BF_SCAN_SIMD
+  if (stride == 2 || stride == 4 || stride == 8) {
+    return hasAVX2() ? scanForwardSIMD<zeroMaskAVX2>(data, size, ptr, stride)
+                     : scanForwardSIMD<zeroMaskSSE2>(data, size, ptr, stride);
+  }
+#endif
+  for (; ptr < size; ptr += stride) {
+    if (data[ptr] == 0) {
+      return ptr;
+    }
+  }
+  return ptr;
+}
+
+// Returns the last index ptr - k * stride (k >= 0) holding a zero cell, or
+// SIZE_MAX if the scan would run off the start of the tape
+size_t scanBackward(const uint8_t *data, size_t ptr, size_t stride) {
+#ifdef __GLIBC__
+  if (stride == 1) {
+    const void *zero = memrchr(data, 0, ptr + 1);
+    return zero ? static_cast<const uint8_t *>(zero) - data : SIZE_MAX;
+  }
+#endif
+#if BF_SCAN_SIMD
+  if (stride == 1 || stride == 2 || stride == 4 || stride == 8) {
+    return hasAVX2() ? scanBackwardSIMD<zeroMaskAVX2>(data, ptr, stride)
+                     : scanBackwardSIMD<zeroMaskSSE2>(data, ptr, stride);
+  }
+#endif
+  for (;; ptr -= stride) {
+    if (data[ptr] == 0) {
+      return ptr;
+    }
+    if (ptr < stride) {
+      return SIZE_MAX;
+    }
+  }
+}
+
+// Tape backed by one large reserved mapping. The kernel commits zeroed
+// pages lazily on first touch, so the hot path needs no bounds checks or
+// reallocation. PROT_NONE guard regions at both ends fault on overruns, and
+// the SIGSEGV handler turns that fault back into the usual tape error.
+class Tape {
+public:
+  uint8_t *begin; // First usable cell
+  uint8_t *end;   // One past the last usable cell
+  uint8_t *start; // Initial data pointer
+
+  // size usable cells are reserved after start, and as many before it if
+  // negative_growth is set. guard_size must cover the furthest any opcode
+  // reaches past a cell the program has already touched.
+  Tape(size_t size, size_t guard_size, bool negative_growth,
+       bool huge_pages) {
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size = roundUp(size, page);
+    guard = roundUp(guard_size, page);
+    size_t usable = negative_growth ? 2 * size : size;
+    length = guard + usable + guard;
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    void *region = mmap(nullptr, length, PROT_NONE, flags, -1, 0);
+    if (region == MAP_FAILED) {
+      throw std::runtime_error("Failed to reserve tape memory.");
+    }
+    base = static_cast<uint8_t *>(region);
+    begin = base + guard;
+    end = begin + usable;
+    start = negative_growth ? begin + size : begin;
+    if (mprotect(begin, usable, PROT_READ | PROT_WRITE) != 0) {
+      munmap(base, length);
+      throw std::runtime_error("Failed to map tape memory.");
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge_pages) {
+      madvise(begin, usable, MADV_HUGEPAGE);
+    }
+#else
+    (void)huge_pages;
+#endif
+  }
+
+  ~Tape() { munmap(base, length); }
+
+  Tape(const Tape &) = delete;
+  Tape &operator=(const Tape &) = delete;
+
+  // Error for a fault at addr, or nullptr if addr is not in a guard region
+  const char *faultMessage(const void *addr) const {
+    const uint8_t *p = static_cast<const uint8_t *>(addr);
+    if (p >= base && p < begin) {
+      return "Data pointer moved before the start of data.";
+    }
+    if (p >= end && p < base + length) {
+      return "Data pointer moved past the end of the tape.";
+    }
+    return nullptr;
+  }
+
+private:
+  uint8_t *base;
+  size_t guard;
+  size_t length;
+
+  static size_t roundUp(size_t n, size_t page) {
+    return (n + page - 1) / page * page;
+  }
+};
+
+namespace {
+const Tape *guarded_tape = nullptr;
+sigjmp_buf tape_fault_jump;
+const char *volatile tape_fault_message = nullptr;
+
+void handleTapeFault(int sig, siginfo_t *info, void *) {
+  const char *message =
+      guarded_tape ? guarded_tape->faultMessage(info->si_addr) : nullptr;
+  if (!message) {
+    // Not a tape overrun: let the fault take its default course
+    signal(sig, SIG_DFL);
+    return;
+  }
+  tape_fault_message = message;
+  siglongjmp(tape_fault_jump, 1);
+}
+
+// Routes faults in the tape's guard regions to handleTapeFault while alive
+class TapeFaultGuard {
+public:
+  explicit TapeFaultGuard(const Tape &tape) {
+    struct sigaction action = {};
+    action.sa_sigaction = handleTapeFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &old_segv);
+    sigaction(SIGBUS, &action, &old_bus);
+    guarded_tape = &tape;
+  }
+
+  ~TapeFaultGuard() {
+    guarded_tape = nullptr;
+    sigaction(SIGSEGV, &old_segv, nullptr);
+    sigaction(SIGBUS, &old_bus, nullptr);
+  }
+
+private:
+  struct sigaction old_segv;
+  struct sigaction old_bus;
+};
+} // namespace
+
+// Runs a Scan with the given stride from ptr, within the bounds of the tape
+uint8_t *scanTape(const Tape &tape, uint8_t *ptr, int stride) {
+  size_t size = tape.end - tape.begin;
+  if (stride > 0) {
+    size_t index = scanForward(tape.begin, size, ptr - tape.begin, stride);
+    if (index >= size) {
+      throw std::runtime_error("Data pointer moved past the end of the tape.");
+    }
+    return tape.begin + index;
+  }
+  size_t index = scanBackward(tape.begin, ptr - tape.begin, -stride);
+  if (index == SIZE_MAX) {
+    throw std::runtime_error("Data pointer moved before the start of data.");
+  }
+  return tape.begin + index;
+}
+
+// JIT policies for run(). NoJit never compiles anything.
+struct NoJit {
+  bool countBackEdge(const ByteCode *) { return false; }
+  uint8_t *runLoop(const ByteCode *, uint8_t *ptr) { return ptr; }
+};
+
+#if defined(__x86_64__)
+#define BF_JIT 1
+#else
+#define BF_JIT 0
+#endif
+
+#if BF_JIT
+// State shared with JIT-compiled code. Helpers called from machine code
+// must not throw through it, so they park the exception here and return a
+// failure value; the compiled loop then returns at once.
+struct JitRuntime {
+  const Tape *tape;
+  InputBuffer *input;
+  OutputBuffer *output;
+  std::exception_ptr error;
+};
+
+int jitOutput(JitRuntime *rt, uint32_t byte) {
+  try {
+    rt->output->put(static_cast<uint8_t>(byte));
+    return 0;
+  } catch (...) {
+    rt->error = std::current_exception();
+    return 1;
+  }
+}
+
+int jitInput(JitRuntime *rt) {
+  try {
+    int ch = rt->input->get();
+    return (ch == EOF) ? 0 : ch;
+  } catch (...) {
+    rt->error = std::current_exception();
+    return -1;
+  }
+}
+
+uint8_t *jitScan(JitRuntime *rt, uint8_t *ptr, int32_t stride) {
+  try {
+    return scanTape(*rt->tape, ptr, stride);
+  } catch (...) {
+    rt->error = std::current_exception();
+    return nullptr;
+  }
+}
+
+// Copy-and-patch code generation. Every opcode has a stencil: its x86-64
+// machine code, encoded ahead of time, with holes where the opcode's
+// operands, branch displacements and helper addresses go. Compiling is a
+// copy of each stencil followed by writes into its holes, so it runs in
+// time linear in the program with no instruction selection at all.
+//
+// Register use in the stencils: RBX holds the data pointer and R12 the
+// JitRuntime; compiled code is called as ptr = code(ptr, runtime).
+enum class Hole : uint8_t {
+  Value8,   // op.value as imm8
+  Value32,  // op.value as imm32
+  Offset32, // op.offset as disp32/imm32
+  Jump32,   // rel32 to the code of program[op.jump]
+  Exit32,   // rel32 to the epilogue, taken when a helper fails
+  Helper64  // Absolute address of the stencil's helper function
+};
+
+struct HoleSite {
+  uint8_t at;
+  Hole kind;
+};
+
+struct Stencil {
+  std::vector<uint8_t> code;
+  std::vector<HoleSite> holes;
+  const void *helper;
+};
+
+// Indexed by OpCode; keep in the same order as the enum
+const Stencil &stencilFor(OpCode code) {
+  static const Stencil stencils[] = {
+      // Add: add byte [rbx + offset], value
+      {{0x80, 0x83, 0, 0, 0, 0, 0},
+       {{2, Hole::Offset32}, {6, Hole::Value8}},
+       nullptr},
+      // Move: add rbx, offset
+      {{0x48, 0x81, 0xC3, 0, 0, 0, 0}, {{3, Hole::Offset32}}, nullptr},
+      // Output: jitOutput(r12, byte [rbx + offset]); exit on failure
+      {{0x4C, 0x89, 0xE7, 0x0F, 0xB6, 0xB3, 0, 0, 0, 0, 0x48, 0xB8, 0, 0, 0,
+        0, 0, 0, 0, 0, 0xFF, 0xD0, 0x85, 0xC0, 0x0F, 0x85, 0, 0, 0, 0},
+       {{6, Hole::Offset32}, {12, Hole::Helper64}, {26, Hole::Exit32}},
+       reinterpret_cast<const void *>(&jitOutput)},
+      // Input: byte [rbx + offset] = jitInput(r12); exit on failure
+      {{0x4C, 0x89, 0xE7, 0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xD0,
+        0x85, 0xC0, 0x0F, 0x88, 0, 0, 0, 0, 0x88, 0x83, 0, 0, 0, 0},
+       {{5, Hole::Helper64}, {19, Hole::Exit32}, {25, Hole::Offset32}},
+       reinterpret_cast<const void *>(&jitInput)},
+      // MulAdd: if byte [rbx] != 0, add byte [rbx + offset], [rbx] * value
+      {{0x0F, 0xB6, 0x03, 0x85, 0xC0, 0x74, 0x0C, 0x69, 0xC0, 0, 0, 0, 0,
+        0x00, 0x83, 0, 0, 0, 0},
+       {{9, Hole::Value32}, {15, Hole::Offset32}},
+       nullptr},
+      // Clear: mov byte [rbx], 0
+      {{0xC6, 0x03, 0x00}, {}, nullptr},
+      // Scan: rbx = jitScan(r12, rbx, offset); exit on failure
+      {{0x4C, 0x89, 0xE7, 0x48, 0x89, 0xDE, 0xBA, 0, 0, 0, 0, 0x48,
+        0xB8, 0,    0,    0,    0,    0,    0,    0, 0, 0xFF, 0xD0, 0x48,
+        0x85, 0xC0, 0x0F, 0x84, 0,    0,    0,    0, 0x48, 0x89, 0xC3},
+       {{7, Hole::Offset32}, {13, Hole::Helper64}, {28, Hole::Exit32}},
+       reinterpret_cast<const void *>(&jitScan)},
+      // NativeLoop: cmp byte [rbx], 0; je past the loop
+      {{0x80, 0x3B, 0x00, 0x0F, 0x84, 0, 0, 0, 0}, {{5, Hole::Jump32}},
+       nullptr},
+      // LoopStart: cmp byte [rbx], 0; je past the loop
+      {{0x80, 0x3B, 0x00, 0x0F, 0x84, 0, 0, 0, 0}, {{5, Hole::Jump32}},
+       nullptr},
+      // LoopEnd: cmp byte [rbx], 0; jne loop body
+      {{0x80, 0x3B, 0x00, 0x0F, 0x85, 0, 0, 0, 0}, {{5, Hole::Jump32}},
+       nullptr},
+      // Halt: falls through to the epilogue
+      {{}, {}, nullptr}};
+  return stencils[static_cast<size_t>(code)];
+}
+
+// push rbx; push r12; push r13 (keeps calls 16-byte aligned);
+// mov rbx, rdi; mov r12, rsi
+const uint8_t stencil_prologue[] = {0x53, 0x41, 0x54, 0x41, 0x55, 0x48,
+                                    0x89, 0xFB, 0x49, 0x89, 0xF4};
+// mov rax, rbx; pop r13; pop r12; pop rbx; ret
+const uint8_t stencil_epilogue[] = {0x48, 0x89, 0xD8, 0x41, 0x5D,
+                                    0x41, 0x5C, 0x5B, 0xC3};
+
+// Stitches stencils into executable functions and owns their memory
+class StencilCompiler {
+public:
+  typedef uint8_t *(*NativeFunction)(uint8_t *ptr, JitRuntime *rt);
+
+  StencilCompiler() = default;
+  StencilCompiler(const StencilCompiler &) = delete;
+  StencilCompiler &operator=(const StencilCompiler &) = delete;
+
+  ~StencilCompiler() {
+    for (const auto &region : regions) {
+      munmap(region.first, region.second);
+    }
+  }
+
+  // Compiles program[start..end]. Branches out of that range must target
+  // end + 1, which becomes the function's return.
+  NativeFunction compile(const std::vector<ByteCode> &program, size_t start,
+                         size_t end) {
+    // First pass: where each opcode's code starts
+    std::vector<size_t> offsets(end - start + 2);
+    size_t size = sizeof(stencil_prologue);
+    for (size_t i = start; i <= end; ++i) {
+      offsets[i - start] = size;
+      size += stencilFor(program[i].code).code.size();
+    }
+    size_t epilogue = size;
+    offsets[end + 1 - start] = epilogue;
+    size += sizeof(stencil_epilogue);
+
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t length = (size + page - 1) / page * page;
+    void *region = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+      return nullptr;
+    }
+    uint8_t *out = static_cast<uint8_t *>(region);
+
+    // Second pass: copy every stencil and patch its holes
+    std::memcpy(out, stencil_prologue, sizeof(stencil_prologue));
+    for (size_t i = start; i <= end; ++i) {
+      const ByteCode &op = program[i];
+      const Stencil &stencil = stencilFor(op.code);
+      uint8_t *at = out + offsets[i - start];
+      if (stencil.code.empty()) {
+        continue;
+      }
+      std::memcpy(at, stencil.code.data(), stencil.code.size());
+      for (const HoleSite &hole : stencil.holes) {
+        uint8_t *site = at + hole.at;
+        switch (hole.kind) {
+        case Hole::Value8:
+          *site = op.value;
+          break;
+        case Hole::Value32:
+          patch32(site, op.value);
+          break;
+        case Hole::Offset32:
+          patch32(site, op.offset);
+          break;
+        case Hole::Jump32:
+          patch32(site, static_cast<int32_t>(out + offsets[op.jump - start] -
+                                             (site + 4)));
+          break;
+        case Hole::Exit32:
+          patch32(site, static_cast<int32_t>(out + epilogue - (site + 4)));
+          break;
+        case Hole::Helper64: {
+          uint64_t address = reinterpret_cast<uint64_t>(stencil.helper);
+          std::memcpy(site, &address, sizeof(address));
+          break;
+        }
+        }
+      }
+    }
+    std::memcpy(out + epilogue, stencil_epilogue, sizeof(stencil_epilogue));
+
+    // Never writable and executable at the same time
+    if (mprotect(region, length, PROT_READ | PROT_EXEC) != 0) {
+      munmap(region, length);
+      return nullptr;
+    }
+    regions.emplace_back(region, length);
+    return reinterpret_cast<NativeFunction>(region);
+  }
+
+private:
+  std::vector<std::pair<void *, size_t>> regions;
+
+  static void patch32(uint8_t *site, int32_t value) {
+    std::memcpy(site, &value, sizeof(value));
+  }
+};
+
+// Compiles hot loops to x86-64 machine code. The interpreter counts the back
+// edges of every loop; once a loop has iterated threshold times, the whole
+// loop (nested loops included) is compiled from its bytecode and its
+// LoopStart is patched into a NativeLoop, so later entries run natively too.
+class LoopJit {
+public:
+  LoopJit(std::vector<ByteCode> &program, size_t loop_count, size_t threshold,
+          const Tape &tape, InputBuffer &input, OutputBuffer &output)
+      : program(program), threshold(threshold), back_edges(loop_count, 0),
+        functions(loop_count, nullptr) {
+    runtime.tape = &tape;
+    runtime.input = &input;
+    runtime.output = &output;
+  }
+
+  // Called on every taken LoopEnd back edge; true once the loop is compiled
+  bool countBackEdge(const ByteCode *pc) {
+    if (++back_edges[pc->loop] != threshold) {
+      return false;
+    }
+    size_t start = pc->jump - 1;
+    size_t end = program[start].jump - 1;
+    functions[pc->loop] = compiler.compile(program, start, end);
+    if (!functions[pc->loop]) {
+      return false;
+    }
+    program[start].code = OpCode::NativeLoop;
+    return true;
+  }
+
+  // Runs the compiled loop from its head; returns the data pointer after it
+  uint8_t *runLoop(const ByteCode *pc, uint8_t *ptr) {
+    ptr = functions[pc->loop](ptr, &runtime);
+    if (runtime.error) {
+      std::exception_ptr error = runtime.error;
+      runtime.error = nullptr;
+      std::rethrow_exception(error);
+    }
+    return ptr;
+  }
+
+private:
+  std::vector<ByteCode> &program;
+  size_t threshold;
+  std::vector<size_t> back_edges; // Indexed by Loop::index
+  std::vector<StencilCompiler::NativeFunction> functions; // Likewise
+  StencilCompiler compiler;
+  JitRuntime runtime;
+};
+
+// Baseline JIT: compiles the whole program with stencils before running it
+// natively, trading the interpreter's zero startup for a few microseconds
+// of compile time
+void runBaselineJit(const std::vector<ByteCode> &program, const Tape &tape,
+                    uint8_t *&data_ptr, InputBuffer &input,
+                    OutputBuffer &output) {
+  StencilCompiler compiler;
+  StencilCompiler::NativeFunction function =
+      compiler.compile(program, 0, program.size() - 1);
+  if (!function) {
+    throw std::runtime_error("Failed to map memory for compiled code.");
+  }
+  JitRuntime runtime;
+  runtime.tape = &tape;
+  runtime.input = &input;
+  runtime.output = &output;
+
+  TapeFaultGuard guard(tape);
+  if (sigsetjmp(tape_fault_jump, 1) != 0) {
+    throw std::runtime_error(tape_fault_message);
+  }
+  data_ptr = function(data_ptr, &runtime);
+  if (runtime.error) {
+    std::rethrow_exception(runtime.error);
+  }
+}
+#endif
+
+// Labels-as-values is a GCC/Clang extension; other compilers only get the
+// switch loop.
+#if defined(__GNUC__) || defined(__clang__)
+#define BF_COMPUTED_GOTO 1
+#else
+#define BF_COMPUTED_GOTO 0
+#endif
+
+enum class DispatchMode { Switch, Threaded };
+
+// Each handler is reachable both as a switch case and as a label. With
+// Threaded set, every handler ends in its own indirect jump to the next
+// handler instead of returning to the shared switch.
+#if BF_COMPUTED_GOTO
+#define BF_HANDLER(op)                                                         \
+  case OpCode::op:                                                             \
+  handle_##op:
+#define BF_NEXT()                                                              \
+  if (Threaded) {                                                              \
+    goto *handlers[static_cast<size_t>(pc->code)];                             \
+  }                                                                            \
+  break
+#else
+#define BF_HANDLER(op) case OpCode::op:
+#define BF_NEXT() break
+#endif
+
+template <bool Threaded, typename ProfilerPolicy, typename JitPolicy>
+void run(const std::vector<ByteCode> &program, const Tape &tape,
+         uint8_t *&data_ptr, InputBuffer &input, OutputBuffer &output,
+         ProfilerPolicy &profiler, JitPolicy &jit) {
+  const ByteCode *code = program.data();
+  const ByteCode *pc = code;
+  uint8_t *ptr = data_ptr;
+
+#if BF_COMPUTED_GOTO
+  // Indexed by OpCode; keep in the same order as the enum
+  static void *const handlers[] = {
+      &&handle_Add,    &&handle_Move,      &&handle_Output,
+      &&handle_Input,  &&handle_MulAdd,    &&handle_Clear,
+      &&handle_Scan,   &&handle_NativeLoop, &&handle_LoopStart,
+      &&handle_LoopEnd, &&handle_Halt};
+  if (Threaded) {
+    goto *handlers[static_cast<size_t>(pc->code)];
+  }
+#endif
+
+  for (;;) {
+    switch (pc->code) {
+      BF_HANDLER(Add) {
+        profiler.countOpcode(pc);
+        ptr[pc->offset] += pc->value;
+        ++pc;
+        BF_NEXT();
+      }
+      BF_HANDLER(Move) {
+        profiler.countOpcode(pc);
+        ptr += pc->offset;
+        ++pc;
+        BF_NEXT();
+      }
+      BF_HANDLER(Output) {
+        profiler.countOpcode(pc);
+        output.put(ptr[pc->offset]);
+        ++pc;
+        BF_NEXT();
+      }
+      BF_HANDLER(Input) {
+        profiler.countOpcode(pc);
+        int ch = input.get();
+        ptr[pc->offset] = (ch == EOF) ? 0 : static_cast<uint8_t>(ch);
+        ++pc;
+        BF_NEXT();
+      }
+      BF_HANDLER(MulAdd) {
+        profiler.countOpcode(pc);
+        // A loop entered on a zero cell never touches its other cells, which
+        // may lie in a guard region
+        if (*ptr != 0) {
+          ptr[pc->offset] += static_cast<uint8_t>(*ptr * pc->value);
+        }
+        ++pc;
+        BF_NEXT();
+      }
+      BF_HANDLER(Clear) {
+        int step = static_cast<int8_t>(pc->value);
+        profiler.countClosedFormLoop(pc, static_cast<uint8_t>(-step * *ptr));
+        *ptr = 0;
+        ++pc;
+        BF_NEXT();
+      }
+      BF_HANDLER(Scan) {
+        uint8_t *start = ptr;
+        ptr = scanTape(tape, ptr, pc->offset);
+        size_t distance = (ptr > start) ? ptr - start : start - ptr;
+        profiler.countClosedFormLoop(pc, distance / std::abs(pc->offset));
+        ++pc;
+        BF_NEXT();
+      }
+      BF_HANDLER(NativeLoop) {
+        ptr = jit.runLoop(pc, ptr);
+        pc = code + pc->jump;
+        BF_NEXT();
+      }
+      BF_HANDLER(LoopStart) {
+        profiler.countOpcode(pc);
+        if (*ptr != 0) {
+          profiler.countIteration(pc);
+        }
+        pc = (*ptr == 0) ? code + pc->jump : pc + 1;
+        BF_NEXT();
+      }
+      BF_HANDLER(LoopEnd) {
+        profiler.countOpcode(pc);
+        if (*ptr != 0) {
+          profiler.countIteration(pc);
+          if (jit.countBackEdge(pc)) {
+            // Finish the loop in the freshly compiled code
+            ptr = jit.runLoop(pc, ptr);
+            ++pc;
+            BF_NEXT();
+          }
+          pc = code + pc->jump;
+        } else {
+          ++pc;
+        }
+        BF_NEXT();
+      }
+      BF_HANDLER(Halt) {
+        profiler.countOpcode(pc);
+        data_ptr = ptr;
+        return;
+      }
+    }
+  }
+}
+
+#undef BF_HANDLER
+#undef BF_NEXT
+
+// Runs the program with tape overruns reported as runtime errors
+template <typename ProfilerPolicy, typename JitPolicy>
+void run(const std::vector<ByteCode> &program, const Tape &tape,
+         uint8_t *&data_ptr, InputBuffer &input, OutputBuffer &output,
+         ProfilerPolicy &profiler, JitPolicy &jit, DispatchMode mode) {
+  TapeFaultGuard guard(tape);
+  if (sigsetjmp(tape_fault_jump, 1) != 0) {
+    throw std::runtime_error(tape_fault_message);
+  }
+  if (mode == DispatchMode::Threaded && BF_COMPUTED_GOTO) {
+    run<true>(program, tape, data_ptr, input, output, profiler, jit);
+  } else {
+    run<false>(program, tape, data_ptr, input, output, profiler, jit);
+  }
+}
+
 int main(int argc, char *argv[]) {
   bool profiler_enabled = false;
+  size_t tape_size = sizeof(void *) >= 8 ? (size_t(1) << 30) : (64u << 20);
+  bool negative_tape = false;
+  bool huge_pages = false;
+  bool line_buffered = isatty(STDOUT_FILENO);
+  bool jit_enabled = false;
+  bool baseline_jit = false;
+  size_t jit_threshold = 1000;
+  DispatchMode dispatch_mode =
+      BF_COMPUTED_GOTO ? DispatchMode::Threaded : DispatchMode::Switch;
   std::string filename;
 
   // Parse command line arguments
@@ -260,6 +1348,35 @@ int main(int argc, char *argv[]) {
     std::string arg = argv[i];
     if (arg == "-p") {
       profiler_enabled = true;
+    } else if (arg == "--dispatch=switch") {
+      dispatch_mode = DispatchMode::Switch;
+    } else if (arg == "--dispatch=threaded") {
+      dispatch_mode = DispatchMode::Threaded;
+    } else if (arg.compare(0, 12, "--tape-size=") == 0) {
+      try {
+        tape_size = std::stoull(arg.substr(12));
+      } catch (const std::exception &) {
+        std::cerr << "Invalid value for --tape-size\n";
+        return 1;
+      }
+    } else if (arg == "--negative-tape") {
+      negative_tape = true;
+    } else if (arg == "--huge-pages") {
+      huge_pages = true;
+    } else if (arg == "--line-buffered") {
+      line_buffered = true;
+    } else if (arg == "--jit") {
+      jit_enabled = true;
+    } else if (arg == "--baseline-jit") {
+      baseline_jit = true;
+    } else if (arg.compare(0, 16, "--jit-threshold=") == 0) {
+      jit_enabled = true;
+      try {
+        jit_threshold = std::max<size_t>(1, std::stoull(arg.substr(16)));
+      } catch (const std::exception &) {
+        std::cerr << "Invalid value for --jit-threshold\n";
+        return 1;
+      }
     } else {
       filename = arg;
     }
@@ -297,18 +1414,45 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  std::vector<uint8_t> data(1, 0);
-  size_t data_ptr = 0;
-
   ExecutionContext context;
   context.instruction_counts.resize(instruction_id, 0);
-  context.profiler_enabled = profiler_enabled;
+
+  OutputBuffer output(STDOUT_FILENO, line_buffered);
+  InputBuffer input_buffer(STDIN_FILENO, output);
 
   try {
-    for (const auto &instr : instructions) {
-      instr->execute(data, data_ptr, std::cin, std::cout, context);
+    std::vector<ByteCode> program = compileProgram(instructions);
+    Tape tape(tape_size, guardSize(program), negative_tape, huge_pages);
+    uint8_t *data_ptr = tape.start;
+    NoJit no_jit;
+    if (profiler_enabled) {
+      // Compiled loops are not profiled, so -p always interprets
+      Profiler profiler(program, loops);
+      run(program, tape, data_ptr, input_buffer, output, profiler, no_jit,
+          dispatch_mode);
+      profiler.collect(program, context);
+    } else if (baseline_jit && BF_JIT) {
+#if BF_JIT
+      runBaselineJit(program, tape, data_ptr, input_buffer, output);
+#endif
+    } else if (jit_enabled && BF_JIT) {
+#if BF_JIT
+      NoProfiler profiler;
+      LoopJit jit(program, loops.size(), jit_threshold, tape, input_buffer,
+                  output);
+      run(program, tape, data_ptr, input_buffer, output, profiler, jit,
+          dispatch_mode);
+#endif
+    } else {
+      NoProfiler profiler;
+      run(program, tape, data_ptr, input_buffer, output, profiler, no_jit,
+          dispatch_mode);
+    }
+    if (!output.flush()) {
+      throw std::runtime_error("Failed to write output.");
     }
   } catch (const std::exception &e) {
+    output.flush();
     std::cerr << "Error during execution: " << e.what() << '\n';
     return 1;
   }
@@ -330,7 +1474,7 @@ int main(int argc, char *argv[]) {
 
     for (Loop *loop : loops) {
       if (loop->is_innermost) {
-        size_t count = context.loop_counts[loop->id];
+        size_t count = context.loop_counts[loop->index];
         if (count > 0) {
           if (loop->is_simple) {
             simple_innermost_loops.emplace_back(loop, count);
@@ -368,6 +1512,31 @@ int main(int argc, char *argv[]) {
       std::cout << "Loop at instruction id " << loop->id << " executed "
                 << count << " times\n";
     }
+
+    // Print the loops that were replaced by Clear/MulAdd or Scan opcodes
+    std::cout << "\nLoops transformed to closed form:\n";
+    for (const auto &pair : non_simple_innermost_loops) {
+      Loop *loop = pair.first;
+      if (loop->scan_stride != 0) {
+        std::cout << "Loop at instruction id " << loop->id
+                  << " replaced by Scan with stride " << loop->scan_stride
+                  << "\n";
+      }
+    }
+    for (const auto &pair : simple_innermost_loops) {
+      Loop *loop = pair.first;
+      size_t multiplies = 0;
+      for (const auto &change : loop->cell_changes) {
+        if (change.first != 0 && (change.second & 0xFF) != 0) {
+          multiplies++;
+        }
+      }
+      std::cout << "Loop at instruction id " << loop->id << " replaced by ";
+      if (multiplies > 0) {
+        std::cout << multiplies << " MulAdd + ";
+      }
+      std::cout << "Clear\n";
+    }
   }
 
   return 0;
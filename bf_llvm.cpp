@@ -1,268 +1,1183 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
-#include <unordered_map>
+#include <thread>
 #include <vector>
 
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/Utils/SplitModule.h>
+
+// Generate the embeddable bf_run entry point instead of main
+bool library_mode = false;
 
+// Code generation threads the data pointer through as an SSA value: each
+// instruction takes the pointer it starts at and returns the pointer it
+// leaves behind, so no pointer ever lives in memory.
 class Instruction {
 public:
   virtual ~Instruction() = default;
   virtual void optimize() {}
-  virtual void generateCode(llvm::IRBuilder<> &builder, llvm::Value *tape_ptr,
-                            llvm::Module *module,
-                            llvm::LLVMContext &context) = 0;
+  virtual llvm::Value *generateCode(llvm::IRBuilder<> &builder,
+                                    llvm::Value *ptr, llvm::Module *module,
+                                    llvm::LLVMContext &context) = 0;
 };
 
-class IncrementDataPointer : public Instruction {
-public:
-  void generateCode(llvm::IRBuilder<> &builder, llvm::Value *tape_ptr,
-                    llvm::Module *, llvm::LLVMContext &context) override {
-    llvm::Value *ptr = builder.CreateLoad(builder.getInt8Ty()->getPointerTo(),
-                                          tape_ptr, "ptr");
-    llvm::Value *new_ptr = builder.CreateInBoundsGEP(
-        builder.getInt8Ty(), ptr, builder.getInt32(1), "ptr_inc");
-    builder.CreateStore(new_ptr, tape_ptr);
+// Memory a load or store touches. The tape, the output buffer, bf_run's
+// input buffer and the runtime's globals never overlap; tagging every
+// access with its TBAA type and alias scope lets alias analysis keep cells
+// in registers across output and calls, even once the tape's address has
+// escaped.
+enum class Memory { Tape, Output, Input, Runtime };
+
+const char *const memory_names[] = {"tape", "output", "input", "runtime"};
+
+llvm::MDNode *aliasScope(llvm::LLVMContext &context, Memory memory) {
+  llvm::MDBuilder md(context);
+  return md.createAliasScope(memory_names[static_cast<int>(memory)],
+                             md.createAliasScopeDomain("brainfuck"));
+}
+
+// Tags a load or store as touching memory and none of the other kinds
+template <typename Access> Access *tagMemory(Access *access, Memory memory) {
+  llvm::LLVMContext &context = access->getContext();
+  llvm::MDBuilder md(context);
+  llvm::MDNode *type = md.createTBAAScalarTypeNode(
+      memory_names[static_cast<int>(memory)], md.createTBAARoot("brainfuck"));
+  access->setMetadata(llvm::LLVMContext::MD_tbaa,
+                      md.createTBAAStructTagNode(type, type, 0));
+
+  std::vector<llvm::Metadata *> others;
+  for (Memory other :
+       {Memory::Tape, Memory::Output, Memory::Input, Memory::Runtime}) {
+    if (other != memory) {
+      others.push_back(aliasScope(context, other));
+    }
   }
-};
+  access->setMetadata(llvm::LLVMContext::MD_alias_scope,
+                      llvm::MDNode::get(context, aliasScope(context, memory)));
+  access->setMetadata(llvm::LLVMContext::MD_noalias,
+                      llvm::MDNode::get(context, others));
+  return access;
+}
+
+// Marks a call to the runtime or libc as never touching the tape
+llvm::CallInst *excludeTape(llvm::CallInst *call) {
+  llvm::LLVMContext &context = call->getContext();
+  call->setMetadata(
+      llvm::LLVMContext::MD_noalias,
+      llvm::MDNode::get(context, aliasScope(context, Memory::Tape)));
+  return call;
+}
 
-class DecrementDataPointer : public Instruction {
+// '>' and '<', folded into a single move by optimize()
+class MovePointer : public Instruction {
 public:
-  void generateCode(llvm::IRBuilder<> &builder, llvm::Value *tape_ptr,
-                    llvm::Module *, llvm::LLVMContext &context) override {
-    llvm::Value *ptr = builder.CreateLoad(builder.getInt8Ty()->getPointerTo(),
-                                          tape_ptr, "ptr");
-    llvm::Value *new_ptr = builder.CreateInBoundsGEP(
-        builder.getInt8Ty(), ptr, builder.getInt32(-1), "ptr_dec");
-    builder.CreateStore(new_ptr, tape_ptr);
+  int delta;
+
+  explicit MovePointer(int delta) : delta(delta) {}
+
+  llvm::Value *generateCode(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                            llvm::Module *, llvm::LLVMContext &) override {
+    return builder.CreateInBoundsGEP(builder.getInt8Ty(), ptr,
+                                     builder.getInt32(delta), "ptr");
   }
 };
 
-class IncrementByte : public Instruction {
+// '+' and '-', folded into one add per cell relative to the current pointer
+class AddToCell : public Instruction {
 public:
-  void generateCode(llvm::IRBuilder<> &builder, llvm::Value *tape_ptr,
-                    llvm::Module *, llvm::LLVMContext &context) override {
-    llvm::Value *ptr = builder.CreateLoad(builder.getInt8Ty()->getPointerTo(),
-                                          tape_ptr, "ptr");
-    llvm::Value *val = builder.CreateLoad(builder.getInt8Ty(), ptr, "val");
-    llvm::Value *inc = builder.CreateAdd(val, builder.getInt8(1), "inc");
-    builder.CreateStore(inc, ptr);
+  int offset;
+  int delta;
+
+  AddToCell(int offset, int delta) : offset(offset), delta(delta) {}
+
+  llvm::Value *generateCode(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                            llvm::Module *, llvm::LLVMContext &) override {
+    llvm::Value *cell_ptr = ptr;
+    if (offset != 0) {
+      cell_ptr = builder.CreateInBoundsGEP(builder.getInt8Ty(), ptr,
+                                           builder.getInt32(offset), "cell");
+    }
+    llvm::Value *val = tagMemory(
+        builder.CreateLoad(builder.getInt8Ty(), cell_ptr, "val"), Memory::Tape);
+    llvm::Value *sum = builder.CreateAdd(
+        val, builder.getInt8(static_cast<uint8_t>(delta)), "sum");
+    tagMemory(builder.CreateStore(sum, cell_ptr), Memory::Tape);
+    return ptr;
   }
 };
 
-class DecrementByte : public Instruction {
-public:
-  void generateCode(llvm::IRBuilder<> &builder, llvm::Value *tape_ptr,
-                    llvm::Module *, llvm::LLVMContext &context) override {
-    llvm::Value *ptr = builder.CreateLoad(builder.getInt8Ty()->getPointerTo(),
-                                          tape_ptr, "ptr");
-    llvm::Value *val = builder.CreateLoad(builder.getInt8Ty(), ptr, "val");
-    llvm::Value *dec = builder.CreateSub(val, builder.getInt8(1), "dec");
-    builder.CreateStore(dec, ptr);
+// Output runtime for generated programs: '.' appends to bf_out_buf with an
+// inline store, and bf_flush hands the buffer to write(2) when it might
+// fill up, before every input and at exit
+const uint64_t output_buffer_size = 1 << 16;
+
+// Most '.' one reservation covers. Each reservation starts a basic block,
+// which keeps blocks short enough for the machine scheduler; it is
+// quadratic in block size without the calls that used to split them.
+const uint64_t output_run_limit = 64;
+
+// Zero-initialized global of the runtime. Thread-local in library mode, so
+// that any number of threads can be inside bf_run at once.
+llvm::GlobalVariable *getRuntimeVariable(llvm::Module *module,
+                                         const char *name, llvm::Type *type) {
+  llvm::GlobalVariable *variable = module->getGlobalVariable(name, true);
+  if (!variable) {
+    // Rather than a new-expression, which g++ pairs with the wrong delete
+    // for User's sized operator new and warns about
+    variable = llvm::cast<llvm::GlobalVariable>(
+        module->getOrInsertGlobal(name, type));
+    variable->setLinkage(llvm::GlobalValue::InternalLinkage);
+    variable->setInitializer(llvm::Constant::getNullValue(type));
+    variable->setThreadLocal(library_mode);
   }
-};
+  return variable;
+}
+
+llvm::GlobalVariable *getOutputBuffer(llvm::Module *module) {
+  return getRuntimeVariable(
+      module, "bf_out_buf",
+      llvm::ArrayType::get(llvm::Type::getInt8Ty(module->getContext()),
+                           output_buffer_size));
+}
+
+llvm::GlobalVariable *getOutputLength(llvm::Module *module) {
+  return getRuntimeVariable(module, "bf_out_len",
+                            llvm::Type::getInt64Ty(module->getContext()));
+}
+
+// ssize_t write(int fd, const void *data, size_t size)
+llvm::FunctionCallee getWriteFunction(llvm::Module *module) {
+  llvm::IRBuilder<> builder(module->getContext());
+  llvm::FunctionCallee write_func = module->getOrInsertFunction(
+      "write", builder.getInt64Ty(), builder.getInt32Ty(),
+      builder.getInt8PtrTy(), builder.getInt64Ty());
+  if (auto *write_decl =
+          llvm::dyn_cast<llvm::Function>(write_func.getCallee())) {
+    write_decl->setDoesNotThrow();
+    write_decl->addParamAttr(1, llvm::Attribute::NoCapture);
+    write_decl->addParamAttr(1, llvm::Attribute::ReadOnly);
+  }
+  return write_func;
+}
+
+// void bf_flush(): writes out the buffered bytes, giving up on write errors.
+// In library mode it copies them to bf_run's output buffer instead.
+llvm::Function *getFlushFunction(llvm::Module *module) {
+  llvm::Function *flush = module->getFunction("bf_flush");
+  if (flush) {
+    return flush;
+  }
+  llvm::LLVMContext &context = module->getContext();
+  llvm::IRBuilder<> builder(context);
+  llvm::GlobalVariable *buffer = getOutputBuffer(module);
+  llvm::GlobalVariable *length = getOutputLength(module);
+
+  // Kept out of line: it is rarely called, and the system call dwarfs the
+  // cost of the call itself
+  flush = llvm::Function::Create(
+      llvm::FunctionType::get(builder.getVoidTy(), false),
+      llvm::Function::InternalLinkage, "bf_flush", module);
+  flush->addFnAttr(llvm::Attribute::NoInline);
+  flush->addFnAttr(llvm::Attribute::Cold);
+  flush->setDoesNotThrow();
+
+  if (library_mode) {
+    // Copies as much as still fits and counts the rest, so that bf_run can
+    // tell its caller how much room the whole output needs
+    llvm::Type *size_type = module->getDataLayout().getIntPtrType(context);
+    llvm::GlobalVariable *out =
+        getRuntimeVariable(module, "bf_run_out", builder.getInt8PtrTy());
+    llvm::GlobalVariable *out_cap =
+        getRuntimeVariable(module, "bf_run_out_cap", size_type);
+    llvm::GlobalVariable *out_total =
+        getRuntimeVariable(module, "bf_run_out_total", size_type);
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(context, "entry", flush);
+    llvm::BasicBlock *copy = llvm::BasicBlock::Create(context, "copy", flush);
+    llvm::BasicBlock *done = llvm::BasicBlock::Create(context, "done", flush);
+
+    builder.SetInsertPoint(entry);
+    llvm::Value *len = builder.CreateZExtOrTrunc(
+        tagMemory(builder.CreateLoad(builder.getInt64Ty(), length, "len"),
+                  Memory::Runtime),
+        size_type);
+    llvm::Value *total = tagMemory(
+        builder.CreateLoad(size_type, out_total, "total"), Memory::Runtime);
+    llvm::Value *cap = tagMemory(builder.CreateLoad(size_type, out_cap, "cap"),
+                                 Memory::Runtime);
+    builder.CreateCondBr(builder.CreateICmpULT(total, cap), copy, done);
+
+    builder.SetInsertPoint(copy);
+    llvm::Value *space = builder.CreateSub(cap, total, "space");
+    llvm::Value *chunk = builder.CreateSelect(builder.CreateICmpULT(len, space),
+                                              len, space, "chunk");
+    llvm::Value *dest = builder.CreateInBoundsGEP(
+        builder.getInt8Ty(),
+        tagMemory(builder.CreateLoad(builder.getInt8PtrTy(), out, "out"),
+                  Memory::Runtime),
+        total);
+    llvm::Value *data =
+        builder.CreateInBoundsGEP(buffer->getValueType(), buffer,
+                                  {builder.getInt64(0), builder.getInt64(0)});
+    builder.CreateMemCpy(dest, llvm::MaybeAlign(1), data, llvm::MaybeAlign(1),
+                         chunk);
+    builder.CreateBr(done);
+
+    builder.SetInsertPoint(done);
+    tagMemory(builder.CreateStore(builder.CreateAdd(total, len), out_total),
+              Memory::Runtime);
+    tagMemory(builder.CreateStore(builder.getInt64(0), length),
+              Memory::Runtime);
+    builder.CreateRetVoid();
+    return flush;
+  }
+
+  llvm::FunctionCallee write_func = getWriteFunction(module);
+  llvm::BasicBlock *entry = llvm::BasicBlock::Create(context, "entry", flush);
+  llvm::BasicBlock *check = llvm::BasicBlock::Create(context, "check", flush);
+  llvm::BasicBlock *write = llvm::BasicBlock::Create(context, "write", flush);
+  llvm::BasicBlock *done = llvm::BasicBlock::Create(context, "done", flush);
+
+  builder.SetInsertPoint(entry);
+  llvm::Value *len = tagMemory(
+      builder.CreateLoad(builder.getInt64Ty(), length, "len"), Memory::Runtime);
+  builder.CreateBr(check);
+
+  builder.SetInsertPoint(check);
+  llvm::PHINode *written = builder.CreatePHI(builder.getInt64Ty(), 2, "done");
+  written->addIncoming(builder.getInt64(0), entry);
+  builder.CreateCondBr(builder.CreateICmpULT(written, len), write, done);
+
+  builder.SetInsertPoint(write);
+  llvm::Value *data = builder.CreateInBoundsGEP(
+      buffer->getValueType(), buffer, {builder.getInt64(0), written});
+  llvm::Value *result = builder.CreateCall(
+      write_func, {builder.getInt32(1), data, builder.CreateSub(len, written)},
+      "result");
+  written->addIncoming(builder.CreateAdd(written, result), write);
+  builder.CreateCondBr(
+      builder.CreateICmpSGT(result, builder.getInt64(0)), check, done);
+
+  builder.SetInsertPoint(done);
+  tagMemory(builder.CreateStore(builder.getInt64(0), length), Memory::Runtime);
+  builder.CreateRetVoid();
+  return flush;
+}
+
+// Writes a fixed message to standard error
+void writeError(llvm::IRBuilder<> &builder, llvm::Module *module,
+                const std::string &message) {
+  builder.CreateCall(
+      getWriteFunction(module),
+      {builder.getInt32(2),
+       builder.CreateGlobalStringPtr(message, "message", 0, module),
+       builder.getInt64(message.size())});
+}
+
+// void bf_tape_fault(int): SIGSEGV/SIGBUS handler. Generated code touches
+// no memory but the tape that could fault, so a fault means the data
+// pointer ran into a guard region. bf_flush only calls write(2), so this
+// is async-signal-safe. Scans that find no zero before the end of the
+// tape call it directly.
+llvm::Function *getTapeFaultFunction(llvm::Module *module) {
+  llvm::Function *fault = module->getFunction("bf_tape_fault");
+  if (fault) {
+    return fault;
+  }
+  llvm::LLVMContext &context = module->getContext();
+  llvm::IRBuilder<> builder(context);
+  fault = llvm::Function::Create(
+      llvm::FunctionType::get(builder.getVoidTy(), {builder.getInt32Ty()},
+                              false),
+      llvm::Function::InternalLinkage, "bf_tape_fault", module);
+  fault->addFnAttr(llvm::Attribute::Cold);
+  fault->setDoesNotReturn();
+  builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", fault));
+
+  // Output the program produced before the overrun comes first
+  builder.CreateCall(getFlushFunction(module));
+  writeError(builder, module,
+             "Error during execution: Data pointer moved outside the "
+             "tape.\n");
+  llvm::FunctionCallee exit_func = module->getOrInsertFunction(
+      "_exit", builder.getVoidTy(), builder.getInt32Ty());
+  builder.CreateCall(exit_func, {builder.getInt32(1)});
+  builder.CreateUnreachable();
+  return fault;
+}
+
+// void bf_output_bytes(i8 *data, i64 size): buffers size bytes at once
+llvm::Function *getOutputBytesFunction(llvm::Module *module) {
+  llvm::Function *output = module->getFunction("bf_output_bytes");
+  if (output) {
+    return output;
+  }
+  llvm::LLVMContext &context = module->getContext();
+  llvm::IRBuilder<> builder(context);
+  llvm::Function *flush = getFlushFunction(module);
+  llvm::GlobalVariable *buffer = getOutputBuffer(module);
+  llvm::GlobalVariable *length = getOutputLength(module);
+
+  output = llvm::Function::Create(
+      llvm::FunctionType::get(builder.getVoidTy(),
+                              {builder.getInt8PtrTy(), builder.getInt64Ty()},
+                              false),
+      llvm::Function::InternalLinkage, "bf_output_bytes", module);
+  output->setDoesNotThrow();
+  output->addParamAttr(0, llvm::Attribute::NoAlias);
+  output->addParamAttr(0, llvm::Attribute::NoCapture);
+  output->addParamAttr(0, llvm::Attribute::ReadOnly);
+  llvm::BasicBlock *entry = llvm::BasicBlock::Create(context, "entry", output);
+  llvm::BasicBlock *check = llvm::BasicBlock::Create(context, "check", output);
+  llvm::BasicBlock *room = llvm::BasicBlock::Create(context, "room", output);
+  llvm::BasicBlock *full = llvm::BasicBlock::Create(context, "full", output);
+  llvm::BasicBlock *copy = llvm::BasicBlock::Create(context, "copy", output);
+  llvm::BasicBlock *done = llvm::BasicBlock::Create(context, "done", output);
+
+  builder.SetInsertPoint(entry);
+  builder.CreateBr(check);
+
+  // Copy as much as fits, flush, repeat
+  builder.SetInsertPoint(check);
+  llvm::PHINode *data = builder.CreatePHI(builder.getInt8PtrTy(), 2, "data");
+  llvm::PHINode *size = builder.CreatePHI(builder.getInt64Ty(), 2, "size");
+  data->addIncoming(output->getArg(0), entry);
+  size->addIncoming(output->getArg(1), entry);
+  builder.CreateCondBr(builder.CreateICmpNE(size, builder.getInt64(0)), room,
+                       done);
+
+  builder.SetInsertPoint(room);
+  llvm::Value *len = tagMemory(
+      builder.CreateLoad(builder.getInt64Ty(), length, "len"), Memory::Runtime);
+  llvm::Value *space =
+      builder.CreateSub(builder.getInt64(output_buffer_size), len, "space");
+  builder.CreateCondBr(builder.CreateICmpEQ(space, builder.getInt64(0)), full,
+                       copy);
+
+  builder.SetInsertPoint(full);
+  builder.CreateCall(flush);
+  builder.CreateBr(room);
+
+  builder.SetInsertPoint(copy);
+  llvm::Value *chunk = builder.CreateSelect(builder.CreateICmpULT(size, space),
+                                            size, space, "chunk");
+  llvm::Value *dest = builder.CreateInBoundsGEP(
+      buffer->getValueType(), buffer, {builder.getInt64(0), len});
+  builder.CreateMemCpy(dest, llvm::MaybeAlign(1), data, llvm::MaybeAlign(1),
+                       chunk);
+  tagMemory(builder.CreateStore(builder.CreateAdd(len, chunk), length),
+            Memory::Runtime);
+  data->addIncoming(
+      builder.CreateInBoundsGEP(builder.getInt8Ty(), data, chunk), copy);
+  size->addIncoming(builder.CreateSub(size, chunk), copy);
+  builder.CreateBr(check);
+
+  builder.SetInsertPoint(done);
+  builder.CreateRetVoid();
+  return output;
+}
+
+// Flushes unless the buffer has room for count more bytes; returns the
+// buffer length afterwards
+llvm::Value *reserveOutput(llvm::IRBuilder<> &builder, llvm::Module *module,
+                           llvm::LLVMContext &context, uint64_t count) {
+  llvm::Value *len = tagMemory(
+      builder.CreateLoad(builder.getInt64Ty(), getOutputLength(module), "len"),
+      Memory::Runtime);
+  llvm::Function *function = builder.GetInsertBlock()->getParent();
+  llvm::BasicBlock *current = builder.GetInsertBlock();
+  llvm::BasicBlock *full =
+      llvm::BasicBlock::Create(context, "output_full", function);
+  llvm::BasicBlock *next =
+      llvm::BasicBlock::Create(context, "output_next", function);
+  // Roughly one reservation in output_buffer_size / count has to flush
+  llvm::MDBuilder md(context);
+  builder.CreateCondBr(
+      builder.CreateICmpUGT(len,
+                            builder.getInt64(output_buffer_size - count)),
+      full, next, md.createBranchWeights(1, output_buffer_size / count));
+  builder.SetInsertPoint(full);
+  excludeTape(builder.CreateCall(getFlushFunction(module)));
+  builder.CreateBr(next);
+
+  builder.SetInsertPoint(next);
+  llvm::PHINode *room_len = builder.CreatePHI(builder.getInt64Ty(), 2, "len");
+  room_len->addIncoming(len, current);
+  room_len->addIncoming(builder.getInt64(0), full);
+  return room_len;
+}
 
 class OutputByte : public Instruction {
 public:
-  void generateCode(llvm::IRBuilder<> &builder, llvm::Value *tape_ptr,
-                    llvm::Module *module, llvm::LLVMContext &context) override {
-    llvm::Function *putchar_func = module->getFunction("putchar");
-    if (!putchar_func) {
-      llvm::FunctionType *putchar_type = llvm::FunctionType::get(
-          builder.getInt32Ty(), {builder.getInt32Ty()}, false);
-      putchar_func = llvm::Function::Create(
-          putchar_type, llvm::Function::ExternalLinkage, "putchar", module);
-    }
-    llvm::Value *ptr = builder.CreateLoad(builder.getInt8Ty()->getPointerTo(),
-                                          tape_ptr, "ptr");
-    llvm::Value *val = builder.CreateLoad(builder.getInt8Ty(), ptr, "val");
-    llvm::Value *val_int32 =
-        builder.CreateZExt(val, builder.getInt32Ty(), "val_int32");
-    builder.CreateCall(putchar_func, val_int32);
+  llvm::Value *generateCode(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                            llvm::Module *module,
+                            llvm::LLVMContext &context) override {
+    llvm::Value *len = reserveOutput(builder, module, context, 1);
+    append(builder, ptr, module, len);
+    tagMemory(builder.CreateStore(builder.CreateAdd(len, builder.getInt64(1)),
+                                  getOutputLength(module)),
+              Memory::Runtime);
+    return ptr;
+  }
+
+  // Stores the current cell at bf_out_buf[index], which the caller has
+  // reserved, leaving bf_out_len to the caller
+  static void append(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                     llvm::Module *module, llvm::Value *index) {
+    llvm::GlobalVariable *buffer = getOutputBuffer(module);
+    llvm::Value *val = tagMemory(
+        builder.CreateLoad(builder.getInt8Ty(), ptr, "val"), Memory::Tape);
+    tagMemory(builder.CreateStore(
+                  val, builder.CreateInBoundsGEP(buffer->getValueType(), buffer,
+                                                 {builder.getInt64(0), index})),
+              Memory::Output);
   }
 };
 
-class InputByte : public Instruction {
+// A run of '.' whose bytes are known at compile time, buffered in one copy
+// from a constant global
+class OutputConstant : public Instruction {
 public:
-  void generateCode(llvm::IRBuilder<> &builder, llvm::Value *tape_ptr,
-                    llvm::Module *module, llvm::LLVMContext &context) override {
+  std::string bytes;
+
+  llvm::Value *generateCode(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                            llvm::Module *module,
+                            llvm::LLVMContext &) override {
+    llvm::Value *data = builder.CreateGlobalStringPtr(bytes, "str", 0, module);
+    excludeTape(builder.CreateCall(getOutputBytesFunction(module),
+                                   {data, builder.getInt64(bytes.size())}));
+    return ptr;
+  }
+};
+
+// int getchar(), or in library mode bf_getchar(), which reads the next
+// byte of bf_run's input buffer, or -1 at its end
+llvm::Function *getInputFunction(llvm::Module *module) {
+  llvm::LLVMContext &context = module->getContext();
+  llvm::IRBuilder<> builder(context);
+  llvm::FunctionType *input_type =
+      llvm::FunctionType::get(builder.getInt32Ty(), false);
+  if (!library_mode) {
     llvm::Function *getchar_func = module->getFunction("getchar");
     if (!getchar_func) {
-      llvm::FunctionType *getchar_type =
-          llvm::FunctionType::get(builder.getInt32Ty(), false);
       getchar_func = llvm::Function::Create(
-          getchar_type, llvm::Function::ExternalLinkage, "getchar", module);
+          input_type, llvm::Function::ExternalLinkage, "getchar", module);
+      getchar_func->setDoesNotThrow();
     }
-    llvm::Value *ch = builder.CreateCall(getchar_func);
+    return getchar_func;
+  }
+
+  llvm::Function *input = module->getFunction("bf_getchar");
+  if (input) {
+    return input;
+  }
+  llvm::Type *size_type = module->getDataLayout().getIntPtrType(context);
+  llvm::GlobalVariable *in =
+      getRuntimeVariable(module, "bf_run_in", builder.getInt8PtrTy());
+  llvm::GlobalVariable *in_len =
+      getRuntimeVariable(module, "bf_run_in_len", size_type);
+  llvm::GlobalVariable *in_pos =
+      getRuntimeVariable(module, "bf_run_in_pos", size_type);
+
+  input = llvm::Function::Create(input_type, llvm::Function::InternalLinkage,
+                                 "bf_getchar", module);
+  input->setDoesNotThrow();
+  llvm::BasicBlock *entry = llvm::BasicBlock::Create(context, "entry", input);
+  llvm::BasicBlock *read = llvm::BasicBlock::Create(context, "read", input);
+  llvm::BasicBlock *end = llvm::BasicBlock::Create(context, "end", input);
+
+  builder.SetInsertPoint(entry);
+  llvm::Value *pos =
+      tagMemory(builder.CreateLoad(size_type, in_pos, "pos"), Memory::Runtime);
+  llvm::Value *len =
+      tagMemory(builder.CreateLoad(size_type, in_len, "len"), Memory::Runtime);
+  builder.CreateCondBr(builder.CreateICmpULT(pos, len), read, end);
+
+  builder.SetInsertPoint(read);
+  llvm::Value *data = tagMemory(
+      builder.CreateLoad(builder.getInt8PtrTy(), in, "in"), Memory::Runtime);
+  llvm::Value *byte = tagMemory(
+      builder.CreateLoad(builder.getInt8Ty(),
+                         builder.CreateInBoundsGEP(builder.getInt8Ty(), data,
+                                                   pos)),
+      Memory::Input);
+  tagMemory(builder.CreateStore(
+                builder.CreateAdd(pos, llvm::ConstantInt::get(size_type, 1)),
+                in_pos),
+            Memory::Runtime);
+  builder.CreateRet(builder.CreateZExt(byte, builder.getInt32Ty()));
+
+  builder.SetInsertPoint(end);
+  builder.CreateRet(builder.getInt32(-1));
+  return input;
+}
+
+class InputByte : public Instruction {
+public:
+  llvm::Value *generateCode(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                            llvm::Module *module,
+                            llvm::LLVMContext &) override {
+    // Interactive programs must see their prompt before blocking on input
+    if (!library_mode) {
+      excludeTape(builder.CreateCall(getFlushFunction(module)));
+    }
+    llvm::Value *ch =
+        excludeTape(builder.CreateCall(getInputFunction(module)));
     llvm::Value *ch_int8 =
         builder.CreateTrunc(ch, builder.getInt8Ty(), "ch_int8");
-    llvm::Value *ptr = builder.CreateLoad(builder.getInt8Ty()->getPointerTo(),
-                                          tape_ptr, "ptr");
-    builder.CreateStore(ch_int8, ptr);
+    tagMemory(builder.CreateStore(ch_int8, ptr), Memory::Tape);
+    return ptr;
+  }
+};
+
+// Generates a sequence of instructions. Each straight-line run of '.'
+// reserves buffer room once and keeps the buffer length in a register,
+// storing it back when the run ends.
+llvm::Value *
+generateBlock(const std::vector<std::unique_ptr<Instruction>> &instructions,
+              llvm::IRBuilder<> &builder, llvm::Value *ptr,
+              llvm::Module *module, llvm::LLVMContext &context) {
+  // Anything else may use the buffer itself
+  auto straight_line = [](const Instruction *instr) {
+    return dynamic_cast<const MovePointer *>(instr) ||
+           dynamic_cast<const AddToCell *>(instr) ||
+           dynamic_cast<const OutputByte *>(instr);
+  };
+
+  llvm::Value *run_len = nullptr; // Buffer length at the start of the run
+  uint64_t room = 0;              // Bytes reserved but not yet written
+  uint64_t written = 0;           // Bytes written by the run so far
+  auto end_run = [&]() {
+    if (run_len) {
+      llvm::Value *len =
+          builder.CreateAdd(run_len, builder.getInt64(written), "len");
+      tagMemory(builder.CreateStore(len, getOutputLength(module)),
+                Memory::Runtime);
+      run_len = nullptr;
+      room = 0;
+    }
+  };
+
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    const Instruction *instr = instructions[i].get();
+    if (!straight_line(instr)) {
+      end_run();
+    } else if (dynamic_cast<const OutputByte *>(instr)) {
+      if (room == 0) {
+        end_run();
+        for (size_t j = i; j < instructions.size() &&
+                           straight_line(instructions[j].get()) &&
+                           room < output_run_limit;
+             ++j) {
+          room += dynamic_cast<const OutputByte *>(instructions[j].get()) ? 1
+                                                                          : 0;
+        }
+        run_len = reserveOutput(builder, module, context, room);
+        written = 0;
+      }
+      OutputByte::append(
+          builder, ptr, module,
+          builder.CreateAdd(run_len, builder.getInt64(written), "index"));
+      ++written;
+      --room;
+      continue;
+    }
+    ptr = instructions[i]->generateCode(builder, ptr, module, context);
+  }
+  end_run();
+  return ptr;
+}
+
+// Folds each run of MovePointer/AddToCell into one AddToCell per touched
+// cell, in offset order, followed by at most one MovePointer
+void foldInstructions(std::vector<std::unique_ptr<Instruction>> &instructions) {
+  std::vector<std::unique_ptr<Instruction>> folded;
+  std::map<int, int> cell_changes;
+  int pointer_offset = 0;
+
+  auto flush = [&]() {
+    for (const auto &change : cell_changes) {
+      if (change.second % 256 != 0) {
+        folded.push_back(
+            std::make_unique<AddToCell>(change.first, change.second));
+      }
+    }
+    cell_changes.clear();
+    if (pointer_offset != 0) {
+      folded.push_back(std::make_unique<MovePointer>(pointer_offset));
+      pointer_offset = 0;
+    }
+  };
+
+  for (auto &instr : instructions) {
+    if (auto *move = dynamic_cast<const MovePointer *>(instr.get())) {
+      pointer_offset += move->delta;
+    } else if (auto *add = dynamic_cast<const AddToCell *>(instr.get())) {
+      cell_changes[pointer_offset + add->offset] += add->delta;
+    } else {
+      flush();
+      folded.push_back(std::move(instr));
+    }
   }
+  flush();
+  instructions = std::move(folded);
+}
+
+// Closed form of a loop whose body only adds to cells around a fixed
+// pointer. With an odd step (the change to p[0] per iteration), the loop
+// runs p[0] * inverse(-step) times mod 256 and adds change * that to every
+// other cell. Even steps may never reach zero, so code generation leaves
+// them as loops; they are only summarized to be evaluated on known values.
+struct LinearSummary {
+  int step;
+  std::map<int, int> changes; // Per-iteration change by offset, excluding 0
 };
 
+// A linear loop whose body may also contain linear loops, e.g. the nested
+// multiply [>[>+<-]<-]. Inner counters must be untouched by the rest of
+// the body, so inner loops only do work on the first outer iteration.
+struct LoopSummary {
+  LinearSummary outer;
+  std::vector<std::pair<int, LinearSummary>> inner; // By counter offset
+};
+
+// Inverse of an odd value mod 256
+uint8_t inverseMod256(int value) {
+  uint8_t odd = static_cast<uint8_t>(value);
+  uint8_t inverse = odd; // Correct to 3 bits; each step doubles that
+  for (int i = 0; i < 3; ++i) {
+    inverse *= static_cast<uint8_t>(2 - odd * inverse);
+  }
+  return inverse;
+}
+
+// Iterations for a counter starting at value to reach zero, if it ever does
+bool tripCount(uint8_t value, int step, uint8_t &trips) {
+  for (int n = 0; n < 256; ++n) {
+    if (static_cast<uint8_t>(value + n * step) == 0) {
+      trips = static_cast<uint8_t>(n);
+      return true;
+    }
+  }
+  return false;
+}
+
 class Loop : public Instruction {
 public:
   std::vector<std::unique_ptr<Instruction>> instructions;
+  size_t id = 0;           // Instruction id of the '[', as in bfi -p
+  uint64_t iterations = 0; // From a profile, or 0 if unknown
+  bool outline = false;    // Generate as a function of its own
 
   void optimize() override {
     for (auto &instr : instructions) {
       instr->optimize();
     }
+    foldInstructions(instructions);
   }
 
-  // Helper method to check if the loop is simple
-  bool isSimpleLoop() const {
+  // Summarizes a loop of adds with no net pointer movement and an odd step,
+  // or any step with any_step set
+  bool summarizeLinear(LinearSummary &summary, bool any_step = false) const {
     int pointer_offset = 0;
-    std::unordered_map<int, int> cell_changes;
+    std::map<int, int> cell_changes;
     for (const auto &instr : instructions) {
-      if (dynamic_cast<const IncrementDataPointer *>(instr.get())) {
-        pointer_offset += 1;
-      } else if (dynamic_cast<const DecrementDataPointer *>(instr.get())) {
-        pointer_offset -= 1;
-      } else if (dynamic_cast<const IncrementByte *>(instr.get())) {
-        cell_changes[pointer_offset] += 1;
-      } else if (dynamic_cast<const DecrementByte *>(instr.get())) {
-        cell_changes[pointer_offset] -= 1;
+      if (auto *move = dynamic_cast<const MovePointer *>(instr.get())) {
+        pointer_offset += move->delta;
+      } else if (auto *add = dynamic_cast<const AddToCell *>(instr.get())) {
+        cell_changes[pointer_offset + add->offset] += add->delta;
       } else {
         // Contains I/O or nested loops
         return false;
       }
     }
-    // Check net pointer movement
-    if (pointer_offset != 0)
-      return false;
-    // Check change to p[0]
-    auto it = cell_changes.find(0);
-    if (it == cell_changes.end() || it->second != -1)
+    if (pointer_offset != 0 || (!any_step && cell_changes[0] % 2 == 0)) {
       return false;
-    // Loop is simple
+    }
+    summary.step = cell_changes[0];
+    cell_changes.erase(0);
+    summary.changes = std::move(cell_changes);
     return true;
   }
 
-  void generateCode(llvm::IRBuilder<> &builder, llvm::Value *tape_ptr,
-                    llvm::Module *module, llvm::LLVMContext &context) override {
-    if (isSimpleLoop()) {
-      // Generate optimized code for simple loop
-      generateOptimizedCode(builder, tape_ptr, module, context);
-    } else {
-      // Generate code for the loop as usual
-      llvm::Function *function = builder.GetInsertBlock()->getParent();
-
-      llvm::BasicBlock *loop_cond =
-          llvm::BasicBlock::Create(context, "loop_cond", function);
-      llvm::BasicBlock *loop_body =
-          llvm::BasicBlock::Create(context, "loop_body", function);
-      llvm::BasicBlock *loop_end =
-          llvm::BasicBlock::Create(context, "loop_end", function);
-
-      builder.CreateBr(loop_cond);
-
-      // Loop condition
-      builder.SetInsertPoint(loop_cond);
-      llvm::Value *ptr = builder.CreateLoad(builder.getInt8Ty()->getPointerTo(),
-                                            tape_ptr, "ptr");
-      llvm::Value *val = builder.CreateLoad(builder.getInt8Ty(), ptr, "val");
-      llvm::Value *cond =
-          builder.CreateICmpNE(val, builder.getInt8(0), "loop_cond");
-      builder.CreateCondBr(cond, loop_body, loop_end);
-
-      // Loop body
-      builder.SetInsertPoint(loop_body);
-      for (const auto &instr : instructions) {
-        instr->generateCode(builder, tape_ptr, module, context);
+  bool summarize(LoopSummary &summary, bool any_step = false) const {
+    int pointer_offset = 0;
+    std::map<int, int> cell_changes;
+    for (const auto &instr : instructions) {
+      if (auto *move = dynamic_cast<const MovePointer *>(instr.get())) {
+        pointer_offset += move->delta;
+      } else if (auto *add = dynamic_cast<const AddToCell *>(instr.get())) {
+        cell_changes[pointer_offset + add->offset] += add->delta;
+      } else if (auto *loop = dynamic_cast<const Loop *>(instr.get())) {
+        LinearSummary inner;
+        if (!loop->summarizeLinear(inner, any_step)) {
+          return false;
+        }
+        summary.inner.emplace_back(pointer_offset, std::move(inner));
+      } else {
+        return false;
       }
-      builder.CreateBr(loop_cond);
+    }
+    if (pointer_offset != 0 || (!any_step && cell_changes[0] % 2 == 0)) {
+      return false;
+    }
 
-      // After loop
-      builder.SetInsertPoint(loop_end);
+    // Each inner counter is written only by its own loop, and no inner loop
+    // writes p[0]
+    std::map<int, int> counters;
+    for (const auto &inner : summary.inner) {
+      if (inner.first == 0 || ++counters[inner.first] > 1 ||
+          cell_changes.count(inner.first)) {
+        return false;
+      }
     }
+    for (const auto &inner : summary.inner) {
+      for (const auto &change : inner.second.changes) {
+        int target = inner.first + change.first;
+        if (target == 0 || counters.count(target)) {
+          return false;
+        }
+      }
+    }
+
+    summary.outer.step = cell_changes[0];
+    cell_changes.erase(0);
+    summary.outer.changes = std::move(cell_changes);
+    return true;
   }
 
-private:
-  void generateOptimizedCode(llvm::IRBuilder<> &builder, llvm::Value *tape_ptr,
-                             llvm::Module *module, llvm::LLVMContext &context) {
-    // Compute cell changes
-    int pointer_offset = 0;
-    std::unordered_map<int, int> cell_changes;
+  // Whether the body reads or writes, directly or in a nested loop
+  bool doesIO() const {
     for (const auto &instr : instructions) {
-      if (dynamic_cast<const IncrementDataPointer *>(instr.get())) {
-        pointer_offset += 1;
-      } else if (dynamic_cast<const DecrementDataPointer *>(instr.get())) {
-        pointer_offset -= 1;
-      } else if (dynamic_cast<const IncrementByte *>(instr.get())) {
-        cell_changes[pointer_offset] += 1;
-      } else if (dynamic_cast<const DecrementByte *>(instr.get())) {
-        cell_changes[pointer_offset] -= 1;
+      auto *loop = dynamic_cast<const Loop *>(instr.get());
+      if (loop ? loop->doesIO()
+               : !dynamic_cast<const MovePointer *>(instr.get()) &&
+                     !dynamic_cast<const AddToCell *>(instr.get())) {
+        return true;
       }
     }
+    return false;
+  }
 
-    // Generate code
-    llvm::Value *ptr = builder.CreateLoad(builder.getInt8Ty()->getPointerTo(),
-                                          tape_ptr, "ptr");
-    llvm::Value *p0 = builder.CreateLoad(builder.getInt8Ty(), ptr, "p0");
-    llvm::Value *p0_i32 =
-        builder.CreateZExt(p0, builder.getInt32Ty(), "p0_i32");
+  // Stride of a scan loop such as [>] or [<<], or 0
+  int scanStride() const {
+    if (instructions.size() != 1) {
+      return 0;
+    }
+    auto *move = dynamic_cast<const MovePointer *>(instructions[0].get());
+    return move ? move->delta : 0;
+  }
 
-    for (const auto &change : cell_changes) {
-      int offset = change.first;
-      int per_iter_change = change.second;
-      if (offset == 0)
-        continue; // We'll set p[0] to zero later
+  // Whether code generation leaves the loop a loop, rather than a closed
+  // form or a scan
+  bool isGeneric() const {
+    LoopSummary summary;
+    return !summarize(summary) && !scanStride();
+  }
+
+  llvm::Value *generateCode(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                            llvm::Module *module,
+                            llvm::LLVMContext &context) override {
+    LoopSummary summary;
+    if (summarize(summary)) {
+      generateClosedForm(builder, ptr, summary);
+      return ptr;
+    }
+    if (int stride = scanStride()) {
+      return generateScan(builder, ptr, stride, module, context);
+    }
+    if (outline) {
+      return generateOutlined(builder, ptr, module, context);
+    }
+    return generateLoop(builder, ptr, module, context);
+  }
+
+private:
+  // Generates the loop into bf_loop_<id>, which takes the pointer the loop
+  // starts at and returns the one it leaves behind, and calls it
+  llvm::Value *generateOutlined(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                                llvm::Module *module,
+                                llvm::LLVMContext &context) {
+    llvm::Type *byte_ptr = builder.getInt8PtrTy();
+    llvm::Function *function = llvm::Function::Create(
+        llvm::FunctionType::get(byte_ptr, {byte_ptr}, false),
+        llvm::Function::InternalLinkage, "bf_loop_" + std::to_string(id),
+        module);
+    function->setDoesNotThrow();
+    llvm::IRBuilder<> body_builder(
+        llvm::BasicBlock::Create(context, "entry", function));
+    body_builder.CreateRet(
+        generateLoop(body_builder, function->getArg(0), module, context));
+    return builder.CreateCall(function, {ptr}, "ptr");
+  }
+
+  llvm::Value *generateLoop(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                            llvm::Module *module, llvm::LLVMContext &context) {
+    llvm::Function *function = builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock *preheader = builder.GetInsertBlock();
+
+    llvm::BasicBlock *loop_cond =
+        llvm::BasicBlock::Create(context, "loop_cond", function);
+    llvm::BasicBlock *loop_body =
+        llvm::BasicBlock::Create(context, "loop_body", function);
+    llvm::BasicBlock *loop_end =
+        llvm::BasicBlock::Create(context, "loop_end", function);
+
+    builder.CreateBr(loop_cond);
+
+    // Loop condition; the pointer is a phi of the entry and back edge values
+    builder.SetInsertPoint(loop_cond);
+    llvm::PHINode *loop_ptr =
+        builder.CreatePHI(builder.getInt8PtrTy(), 2, "loop_ptr");
+    loop_ptr->addIncoming(ptr, preheader);
+    llvm::Value *val = tagMemory(
+        builder.CreateLoad(builder.getInt8Ty(), loop_ptr, "val"), Memory::Tape);
+    llvm::Value *cond =
+        builder.CreateICmpNE(val, builder.getInt8(0), "loop_cond");
+    llvm::BranchInst *branch = builder.CreateCondBr(cond, loop_body, loop_end);
+    if (iterations) {
+      // Only iterations are profiled, so the weights overstate trip counts
+      // of loops entered many times; they still rank hot loops correctly
+      llvm::MDBuilder md(context);
+      branch->setMetadata(
+          llvm::LLVMContext::MD_prof,
+          md.createBranchWeights(
+              static_cast<uint32_t>(std::min<uint64_t>(iterations, UINT32_MAX)),
+              1));
+    }
+
+    // Loop body
+    builder.SetInsertPoint(loop_body);
+    llvm::Value *body_ptr =
+        generateBlock(instructions, builder, loop_ptr, module, context);
+    loop_ptr->addIncoming(body_ptr, builder.GetInsertBlock());
+    builder.CreateBr(loop_cond)->setMetadata(llvm::LLVMContext::MD_loop,
+                                             loopID(context));
+
+    // After loop
+    builder.SetInsertPoint(loop_end);
+    return loop_ptr;
+  }
+
+  // Distinct llvm.loop ID for the back edge. Unrolling a body that does
+  // I/O only multiplies its calls and buffer checks, so it is disabled.
+  // Loops are not marked mustprogress: an infinite loop is a valid program.
+  llvm::MDNode *loopID(llvm::LLVMContext &context) const {
+    std::vector<llvm::Metadata *> properties = {nullptr};
+    if (doesIO()) {
+      properties.push_back(llvm::MDNode::get(
+          context, llvm::MDString::get(context, "llvm.loop.unroll.disable")));
+    }
+    llvm::MDNode *id = llvm::MDNode::getDistinct(context, properties);
+    id->replaceOperandWith(0, id);
+    return id;
+  }
 
-      llvm::Value *offset_val = builder.getInt32(offset);
-      llvm::Value *cell_ptr = builder.CreateInBoundsGEP(
-          builder.getInt8Ty(), ptr, offset_val, "cell_ptr");
+  static llvm::Value *cellAt(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                             int offset) {
+    if (offset == 0) {
+      return ptr;
+    }
+    return builder.CreateInBoundsGEP(builder.getInt8Ty(), ptr,
+                                     builder.getInt32(offset), "cell_ptr");
+  }
 
-      llvm::Value *cell_val = builder.CreateLoad(builder.getInt8Ty(), cell_ptr);
-      llvm::Value *cell_val_i32 =
-          builder.CreateZExt(cell_val, builder.getInt32Ty(), "cell_val_i32");
+  // Applies a linear loop whose counter is at offset. With run set, the
+  // loop only takes effect where run is true. A loop that does not run
+  // reads and rewrites p[0] in place of its own cells, which may lie past
+  // the end of the tape: bf_run's tape may end where the caller's mapping
+  // does, and main's ends at a guard region.
+  static void generateLinear(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                             int offset, const LinearSummary &summary,
+                             llvm::Value *run) {
+    // i8 arithmetic wraps mod 256, exactly like the cells
+    llvm::Value *counter_ptr = cellAt(builder, ptr, offset);
+    if (run) {
+      counter_ptr = builder.CreateSelect(run, counter_ptr, ptr, "counter_ptr");
+    }
+    llvm::Value *counter = tagMemory(
+        builder.CreateLoad(builder.getInt8Ty(), counter_ptr, "counter"),
+        Memory::Tape);
+    llvm::Value *trip_count = builder.CreateMul(
+        counter, builder.getInt8(inverseMod256(-summary.step)), "trip_count");
+    if (run) {
+      trip_count =
+          builder.CreateSelect(run, trip_count, builder.getInt8(0), "trips");
+    }
 
-      llvm::Value *change_val =
-          builder.getInt32(per_iter_change); // per_iter_change * p0_i32
-      llvm::Value *total_change =
-          builder.CreateMul(change_val, p0_i32, "total_change");
+    llvm::Value *runs = builder.CreateICmpNE(trip_count, builder.getInt8(0));
+    for (const auto &change : summary.changes) {
+      llvm::Value *cell_ptr = cellAt(builder, ptr, offset + change.first);
+      cell_ptr = builder.CreateSelect(runs, cell_ptr, ptr, "cell_ptr");
+      llvm::Value *cell = tagMemory(
+          builder.CreateLoad(builder.getInt8Ty(), cell_ptr), Memory::Tape);
+      llvm::Value *total = builder.CreateMul(
+          trip_count, builder.getInt8(static_cast<uint8_t>(change.second)),
+          "total_change");
+      tagMemory(builder.CreateStore(builder.CreateAdd(cell, total, "new_cell"),
+                                    cell_ptr),
+                Memory::Tape);
+    }
 
-      llvm::Value *new_cell_val_i32 =
-          builder.CreateAdd(cell_val_i32, total_change, "new_cell_val_i32");
+    llvm::Value *exit_value = builder.getInt8(0);
+    if (run) {
+      exit_value = builder.CreateSelect(run, exit_value, counter);
+    }
+    tagMemory(builder.CreateStore(exit_value, counter_ptr), Memory::Tape);
+  }
 
-      llvm::Value *new_cell_val = builder.CreateTrunc(
-          new_cell_val_i32, builder.getInt8Ty(), "new_cell_val");
-      builder.CreateStore(new_cell_val, cell_ptr);
+  void generateClosedForm(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                          const LoopSummary &summary) {
+    if (!summary.inner.empty()) {
+      llvm::Value *p0 = tagMemory(
+          builder.CreateLoad(builder.getInt8Ty(), ptr, "p0"), Memory::Tape);
+      llvm::Value *runs =
+          builder.CreateICmpNE(p0, builder.getInt8(0), "outer_runs");
+      for (const auto &inner : summary.inner) {
+        generateLinear(builder, ptr, inner.first, inner.second, runs);
+      }
     }
+    generateLinear(builder, ptr, 0, summary.outer, nullptr);
+  }
+
+  // Moves the pointer by stride until it reaches a zero cell. Forward unit
+  // scans call memchr over the rest of the tape; memrchr is GNU-only, so
+  // other scans are a tight loop of their own.
+  static llvm::Value *generateScan(llvm::IRBuilder<> &builder,
+                                   llvm::Value *ptr, int stride,
+                                   llvm::Module *module,
+                                   llvm::LLVMContext &context) {
+    llvm::Function *function = builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock *preheader = builder.GetInsertBlock();
 
-    // Set p[0] to zero
-    builder.CreateStore(builder.getInt8(0), ptr);
+    if (stride == 1) {
+      llvm::Type *size_type = module->getDataLayout().getIntPtrType(context);
+      llvm::FunctionCallee memchr_func = module->getOrInsertFunction(
+          "memchr", builder.getInt8PtrTy(), builder.getInt8PtrTy(),
+          builder.getInt32Ty(), size_type);
+      if (auto *memchr_decl =
+              llvm::dyn_cast<llvm::Function>(memchr_func.getCallee())) {
+        memchr_decl->setOnlyReadsMemory();
+        memchr_decl->setOnlyAccessesArgMemory();
+        memchr_decl->setDoesNotThrow();
+      }
+      llvm::Value *tape_end = tagMemory(
+          builder.CreateLoad(
+              builder.getInt8PtrTy(),
+              getRuntimeVariable(module, "tape_end", builder.getInt8PtrTy()),
+              "tape_end"),
+          Memory::Runtime);
+      llvm::Value *remaining = builder.CreateSub(
+          builder.CreatePtrToInt(tape_end, size_type),
+          builder.CreatePtrToInt(ptr, size_type), "remaining");
+      llvm::Value *found = builder.CreateCall(
+          memchr_func, {ptr, builder.getInt32(0), remaining}, "found");
+
+      // No zero before the end of the tape: the program ran off it
+      llvm::BasicBlock *overrun =
+          llvm::BasicBlock::Create(context, "scan_overrun", function);
+      llvm::BasicBlock *scan_end =
+          llvm::BasicBlock::Create(context, "scan_end", function);
+      builder.CreateCondBr(builder.CreateIsNull(found), overrun, scan_end);
+      builder.SetInsertPoint(overrun);
+      if (library_mode) {
+        builder.CreateCall(
+            llvm::Intrinsic::getDeclaration(module, llvm::Intrinsic::trap));
+      } else {
+        builder.CreateCall(getTapeFaultFunction(module),
+                           {builder.getInt32(0)});
+      }
+      builder.CreateUnreachable();
+      builder.SetInsertPoint(scan_end);
+      return found;
+    }
+
+    llvm::BasicBlock *scan =
+        llvm::BasicBlock::Create(context, "scan", function);
+    llvm::BasicBlock *scan_end =
+        llvm::BasicBlock::Create(context, "scan_end", function);
+    builder.CreateBr(scan);
+
+    builder.SetInsertPoint(scan);
+    llvm::PHINode *scan_ptr =
+        builder.CreatePHI(builder.getInt8PtrTy(), 2, "scan_ptr");
+    scan_ptr->addIncoming(ptr, preheader);
+    llvm::Value *val = tagMemory(
+        builder.CreateLoad(builder.getInt8Ty(), scan_ptr, "val"), Memory::Tape);
+    llvm::Value *next = builder.CreateInBoundsGEP(
+        builder.getInt8Ty(), scan_ptr, builder.getInt32(stride), "next");
+    scan_ptr->addIncoming(next, scan);
+    builder.CreateCondBr(builder.CreateICmpNE(val, builder.getInt8(0)), scan,
+                         scan_end);
+
+    builder.SetInsertPoint(scan_end);
+    return scan_ptr;
   }
 };
 
-std::vector<std::unique_ptr<Instruction>> parse(const std::string &code,
-                                                size_t &index) {
+// Tracks cell values from the start of the program, where every cell is
+// known to be zero, and replaces each '.' of a known value with constant
+// output. Closed-form loops with known counters are evaluated into adds.
+// Outputs separated only by adds and moves share one OutputConstant. The
+// walk stops at the first loop it cannot follow.
+void coalesceConstantOutput(
+    std::vector<std::unique_ptr<Instruction>> &instructions) {
+  std::vector<std::unique_ptr<Instruction>> result;
+  std::map<int, uint8_t> values; // Valid unless the cell is marked unknown
+  std::map<int, bool> unknown;
+  OutputConstant *run = nullptr;
+  int position = 0;
+
+  auto known = [&](int cell) { return !unknown.count(cell); };
+  auto add = [&](int cell, int delta) {
+    values[cell] = static_cast<uint8_t>(values[cell] + delta);
+    if (static_cast<uint8_t>(delta) != 0) {
+      result.push_back(std::make_unique<AddToCell>(cell - position, delta));
+    }
+  };
+
+  size_t i = 0;
+  for (; i < instructions.size(); ++i) {
+    Instruction *instr = instructions[i].get();
+    if (auto *move = dynamic_cast<MovePointer *>(instr)) {
+      position += move->delta;
+    } else if (auto *cell_add = dynamic_cast<AddToCell *>(instr)) {
+      int cell = position + cell_add->offset;
+      values[cell] = static_cast<uint8_t>(values[cell] + cell_add->delta);
+    } else if (dynamic_cast<OutputByte *>(instr) && known(position)) {
+      if (!run) {
+        auto output = std::make_unique<OutputConstant>();
+        run = output.get();
+        result.push_back(std::move(output));
+      }
+      run->bytes.push_back(static_cast<char>(values[position]));
+      continue;
+    } else if (auto *loop = dynamic_cast<Loop *>(instr)) {
+      if (known(position) && values[position] == 0) {
+        continue; // Never entered
+      }
+      LoopSummary summary;
+      if (!loop->summarize(summary, true)) {
+        break;
+      }
+      bool counters_known = known(position);
+      for (const auto &inner : summary.inner) {
+        counters_known &= known(position + inner.first);
+      }
+      if (!counters_known) {
+        // Runs at run time; only its exit value is certain
+        for (const auto &inner : summary.inner) {
+          unknown[position + inner.first] = true;
+          for (const auto &change : inner.second.changes) {
+            unknown[position + inner.first + change.first] = true;
+          }
+        }
+        for (const auto &change : summary.outer.changes) {
+          unknown[position + change.first] = true;
+        }
+        unknown.erase(position);
+        values[position] = 0;
+        run = nullptr;
+        result.push_back(std::move(instructions[i]));
+        continue;
+      }
+
+      // The counter is known to be non-zero here, so inner loops run once.
+      // A loop that never terminates is left for run time.
+      std::vector<uint8_t> inner_trips(summary.inner.size());
+      uint8_t trips = 0;
+      bool terminates =
+          tripCount(values[position], summary.outer.step, trips);
+      for (size_t j = 0; j < summary.inner.size(); ++j) {
+        terminates &= tripCount(values[position + summary.inner[j].first],
+                                summary.inner[j].second.step, inner_trips[j]);
+      }
+      if (!terminates) {
+        break;
+      }
+      for (size_t j = 0; j < summary.inner.size(); ++j) {
+        int counter = position + summary.inner[j].first;
+        for (const auto &change : summary.inner[j].second.changes) {
+          add(counter + change.first, inner_trips[j] * change.second);
+        }
+        add(counter, -values[counter]);
+      }
+      for (const auto &change : summary.outer.changes) {
+        add(position + change.first, trips * change.second);
+      }
+      add(position, -values[position]);
+      continue;
+    } else if (dynamic_cast<InputByte *>(instr)) {
+      unknown[position] = true;
+      run = nullptr;
+    } else {
+      run = nullptr;
+    }
+    result.push_back(std::move(instructions[i]));
+  }
+  for (; i < instructions.size(); ++i) {
+    result.push_back(std::move(instructions[i]));
+  }
+  instructions = std::move(result);
+}
+
+// Numbers every command but ']' from instruction_id on, like the
+// interpreter, so that loops can be matched with its profile
+std::vector<std::unique_ptr<Instruction>>
+parse(const std::string &code, size_t &index, size_t &instruction_id) {
   std::vector<std::unique_ptr<Instruction>> instructions;
 
   while (index < code.size()) {
     char cmd = code[index++];
+    if (cmd == '>' || cmd == '<' || cmd == '+' || cmd == '-' || cmd == '.' ||
+        cmd == ',' || cmd == '[') {
+      ++instruction_id;
+    }
     switch (cmd) {
     case '>':
-      instructions.push_back(std::make_unique<IncrementDataPointer>());
+      instructions.push_back(std::make_unique<MovePointer>(1));
       break;
     case '<':
-      instructions.push_back(std::make_unique<DecrementDataPointer>());
+      instructions.push_back(std::make_unique<MovePointer>(-1));
       break;
     case '+':
-      instructions.push_back(std::make_unique<IncrementByte>());
+      instructions.push_back(std::make_unique<AddToCell>(0, 1));
       break;
     case '-':
-      instructions.push_back(std::make_unique<DecrementByte>());
+      instructions.push_back(std::make_unique<AddToCell>(0, -1));
       break;
     case '.':
       instructions.push_back(std::make_unique<OutputByte>());
@@ -272,7 +1187,8 @@ std::vector<std::unique_ptr<Instruction>> parse(const std::string &code,
       break;
     case '[': {
       auto loop = std::make_unique<Loop>();
-      loop->instructions = parse(code, index);
+      loop->id = instruction_id - 1;
+      loop->instructions = parse(code, index, instruction_id);
       instructions.push_back(std::move(loop));
       break;
     }
@@ -286,84 +1202,686 @@ std::vector<std::unique_ptr<Instruction>> parse(const std::string &code,
   return instructions;
 }
 
+// Reads loop iteration counts from the interpreter's -p report
+bool readProfile(const std::string &path, std::map<size_t, uint64_t> &counts) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Failed to open file: " << path << '\n';
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    unsigned long long id, count;
+    if (std::sscanf(line.c_str(), "Loop at instruction id %llu executed %llu",
+                    &id, &count) == 2) {
+      counts[id] = count;
+    }
+  }
+  return true;
+}
+
+void applyProfile(std::vector<std::unique_ptr<Instruction>> &instructions,
+                  const std::map<size_t, uint64_t> &counts) {
+  for (auto &instr : instructions) {
+    if (auto *loop = dynamic_cast<Loop *>(instr.get())) {
+      auto count = counts.find(loop->id);
+      if (count != counts.end()) {
+        loop->iterations = count->second;
+      }
+      applyProfile(loop->instructions, counts);
+    }
+  }
+}
+
 void optimizeInstructions(
     std::vector<std::unique_ptr<Instruction>> &instructions) {
   for (auto &instr : instructions) {
     instr->optimize();
   }
+  foldInstructions(instructions);
+  coalesceConstantOutput(instructions);
+  foldInstructions(instructions);
+}
+
+// Instructions in a sequence, counting those in loops
+size_t countInstructions(
+    const std::vector<std::unique_ptr<Instruction>> &instructions) {
+  size_t count = instructions.size();
+  for (const auto &instr : instructions) {
+    if (auto *loop = dynamic_cast<const Loop *>(instr.get())) {
+      count += countInstructions(loop->instructions);
+    }
+  }
+  return count;
+}
+
+// Smallest loop nest worth a function of its own; a call costs nothing
+// next to a body this size
+const size_t outline_min_size = 256;
+
+// Outlines loop nests of at least outline_min_size instructions that stay
+// loops, at any depth, so that a module split across threads has more than
+// main to spread: generated programs tend to be one huge top-level loop.
+void outlineLoops(std::vector<std::unique_ptr<Instruction>> &instructions) {
+  for (auto &instr : instructions) {
+    if (auto *loop = dynamic_cast<Loop *>(instr.get())) {
+      loop->outline = loop->isGeneric() &&
+                      countInstructions(loop->instructions) >= outline_min_size;
+      outlineLoops(loop->instructions);
+    }
+  }
+}
+
+// Tape runtime. Generated code always targets the host, so the mmap and
+// signal constants are taken from the host's own headers.
+
+// Maps tape_size cells between two PROT_NONE guard regions of margin
+// bytes. Stores the end of the tape in tape_end and routes faults to
+// bf_tape_fault. The kernel zeroes pages lazily, on first touch. Returns the
+// first cell; if the tape cannot be mapped, main returns 1.
+llvm::Value *allocateTape(llvm::IRBuilder<> &builder, llvm::Module *module,
+                          uint64_t tape_size, uint64_t margin) {
+  llvm::LLVMContext &context = module->getContext();
+  llvm::Function *function = builder.GetInsertBlock()->getParent();
+  llvm::Type *size_type = module->getDataLayout().getIntPtrType(context);
+  llvm::Type *byte_ptr = builder.getInt8PtrTy();
+
+  // The mapping is fresh memory, which tells alias analysis the tape
+  // overlaps nothing else
+  llvm::FunctionCallee mmap_func = module->getOrInsertFunction(
+      "mmap", byte_ptr, byte_ptr, size_type, builder.getInt32Ty(),
+      builder.getInt32Ty(), builder.getInt32Ty(), builder.getInt64Ty());
+  if (auto *mmap_decl =
+          llvm::dyn_cast<llvm::Function>(mmap_func.getCallee())) {
+    mmap_decl->addRetAttr(llvm::Attribute::NoAlias);
+    mmap_decl->setDoesNotThrow();
+  }
+  llvm::FunctionCallee mprotect_func = module->getOrInsertFunction(
+      "mprotect", builder.getInt32Ty(), byte_ptr, size_type,
+      builder.getInt32Ty());
+  llvm::FunctionCallee signal_func = module->getOrInsertFunction(
+      "signal", byte_ptr, builder.getInt32Ty(), byte_ptr);
+
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+  flags |= MAP_NORESERVE;
+#endif
+  llvm::Value *base = builder.CreateCall(
+      mmap_func,
+      {llvm::ConstantPointerNull::get(builder.getInt8PtrTy()),
+       llvm::ConstantInt::get(size_type, 2 * margin + tape_size),
+       builder.getInt32(PROT_NONE), builder.getInt32(flags),
+       builder.getInt32(-1), builder.getInt64(0)},
+      "tape_base");
+
+  llvm::BasicBlock *protect =
+      llvm::BasicBlock::Create(context, "tape_protect", function);
+  llvm::BasicBlock *failed =
+      llvm::BasicBlock::Create(context, "tape_failed", function);
+  llvm::BasicBlock *ready =
+      llvm::BasicBlock::Create(context, "tape_ready", function);
+  llvm::Value *map_failed = builder.CreateIntToPtr(
+      llvm::ConstantInt::get(size_type, -1), byte_ptr);
+  builder.CreateCondBr(builder.CreateICmpEQ(base, map_failed), failed,
+                       protect);
+
+  builder.SetInsertPoint(protect);
+  llvm::Value *result = builder.CreateCall(
+      mprotect_func,
+      {builder.CreateInBoundsGEP(builder.getInt8Ty(), base,
+                                 llvm::ConstantInt::get(size_type, margin)),
+       llvm::ConstantInt::get(size_type, tape_size),
+       builder.getInt32(PROT_READ | PROT_WRITE)});
+  builder.CreateCondBr(builder.CreateICmpNE(result, builder.getInt32(0)),
+                       failed, ready);
+
+  builder.SetInsertPoint(failed);
+  writeError(builder, module, "Error: Failed to reserve tape memory.\n");
+  builder.CreateRet(builder.getInt32(1));
+
+  builder.SetInsertPoint(ready);
+  llvm::Value *tape = builder.CreateInBoundsGEP(
+      builder.getInt8Ty(), base, llvm::ConstantInt::get(size_type, margin),
+      "tape");
+  llvm::GlobalVariable *tape_end =
+      getRuntimeVariable(module, "tape_end", byte_ptr);
+  tagMemory(builder.CreateStore(
+                builder.CreateInBoundsGEP(
+                    builder.getInt8Ty(), tape,
+                    llvm::ConstantInt::get(size_type, tape_size)),
+                tape_end),
+            Memory::Runtime);
+
+  llvm::Value *handler =
+      builder.CreateBitCast(getTapeFaultFunction(module), byte_ptr);
+  builder.CreateCall(signal_func, {builder.getInt32(SIGSEGV), handler});
+  builder.CreateCall(signal_func, {builder.getInt32(SIGBUS), handler});
+  return tape;
+}
+
+// Unmaps the tape allocateTape returned, with its guard regions
+void freeTape(llvm::IRBuilder<> &builder, llvm::Module *module,
+              llvm::Value *tape, uint64_t tape_size, uint64_t margin) {
+  llvm::LLVMContext &context = module->getContext();
+  llvm::Type *size_type = module->getDataLayout().getIntPtrType(context);
+  llvm::FunctionCallee munmap_func = module->getOrInsertFunction(
+      "munmap", builder.getInt32Ty(), builder.getInt8PtrTy(), size_type);
+  llvm::Value *base = builder.CreateGEP(
+      builder.getInt8Ty(), tape,
+      llvm::ConstantInt::get(size_type, -static_cast<int64_t>(margin)));
+  builder.CreateCall(munmap_func,
+                     {base, llvm::ConstantInt::get(size_type,
+                                                   2 * margin + tape_size)});
+}
+
+// Creates int bf_run(uint8_t *tape, size_t tape_len, const uint8_t *in,
+// size_t in_len, uint8_t *out, size_t out_cap), the library mode entry
+// point, and starts its body by storing the arguments in the runtime's
+// thread-local state. The tape belongs to the caller, who zeroes it; the
+// buffers may not overlap. Returns the tape.
+llvm::Value *beginRunFunction(llvm::IRBuilder<> &builder,
+                              llvm::Module *module) {
+  llvm::LLVMContext &context = module->getContext();
+  llvm::Type *size_type = module->getDataLayout().getIntPtrType(context);
+  llvm::Type *byte_ptr = builder.getInt8PtrTy();
+  llvm::Function *run = llvm::Function::Create(
+      llvm::FunctionType::get(builder.getInt32Ty(),
+                              {byte_ptr, size_type, byte_ptr, size_type,
+                               byte_ptr, size_type},
+                              false),
+      llvm::Function::ExternalLinkage, "bf_run", module);
+  run->setDoesNotThrow();
+  for (unsigned arg : {0, 2, 4}) {
+    run->addParamAttr(arg, llvm::Attribute::NoAlias);
+  }
+  llvm::Value *tape = run->getArg(0);
+  tape->setName("tape");
+  run->getArg(1)->setName("tape_len");
+  run->getArg(2)->setName("in");
+  run->getArg(3)->setName("in_len");
+  run->getArg(4)->setName("out");
+  run->getArg(5)->setName("out_cap");
+  builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", run));
+
+  auto set = [&](const char *name, llvm::Value *value) {
+    tagMemory(builder.CreateStore(
+                  value, getRuntimeVariable(module, name, value->getType())),
+              Memory::Runtime);
+  };
+  set("tape_end", builder.CreateInBoundsGEP(builder.getInt8Ty(), tape,
+                                            run->getArg(1)));
+  set("bf_run_in", run->getArg(2));
+  set("bf_run_in_len", run->getArg(3));
+  set("bf_run_in_pos", llvm::ConstantInt::get(size_type, 0));
+  set("bf_run_out", run->getArg(4));
+  set("bf_run_out_cap", run->getArg(5));
+  set("bf_run_out_total", llvm::ConstantInt::get(size_type, 0));
+  set("bf_out_len", builder.getInt64(0));
+  return tape;
+}
+
+// Ends bf_run: flushes into the output buffer and returns how many bytes
+// the program output, up to INT_MAX. More than out_cap means the output was
+// cut short.
+void endRunFunction(llvm::IRBuilder<> &builder, llvm::Module *module) {
+  llvm::LLVMContext &context = module->getContext();
+  llvm::Type *size_type = module->getDataLayout().getIntPtrType(context);
+  excludeTape(builder.CreateCall(getFlushFunction(module)));
+  llvm::Value *total = tagMemory(
+      builder.CreateLoad(size_type,
+                         getRuntimeVariable(module, "bf_run_out_total",
+                                            size_type),
+                         "total"),
+      Memory::Runtime);
+  llvm::Value *int_max = llvm::ConstantInt::get(size_type, INT32_MAX);
+  llvm::Value *result = builder.CreateSelect(
+      builder.CreateICmpULT(total, int_max), total, int_max);
+  builder.CreateRet(builder.CreateTrunc(result, builder.getInt32Ty()));
+}
+
+// Creates a TargetMachine for the host and sets the module's triple and
+// data layout to match it
+std::unique_ptr<llvm::TargetMachine>
+createTargetMachine(llvm::Module &module, unsigned opt_level) {
+  std::string triple = llvm::sys::getDefaultTargetTriple();
+  std::string error;
+  const llvm::Target *target =
+      llvm::TargetRegistry::lookupTarget(triple, error);
+  if (!target) {
+    std::cerr << "Error: " << error << '\n';
+    return nullptr;
+  }
+
+  llvm::SubtargetFeatures features;
+  llvm::StringMap<bool> host_features;
+  if (llvm::sys::getHostCPUFeatures(host_features)) {
+    for (const auto &feature : host_features) {
+      features.AddFeature(feature.first(), feature.second);
+    }
+  }
+
+#if LLVM_VERSION_MAJOR >= 18
+  const llvm::CodeGenOptLevel levels[] = {
+      llvm::CodeGenOptLevel::None, llvm::CodeGenOptLevel::Less,
+      llvm::CodeGenOptLevel::Default, llvm::CodeGenOptLevel::Aggressive};
+#else
+  const llvm::CodeGenOpt::Level levels[] = {
+      llvm::CodeGenOpt::None, llvm::CodeGenOpt::Less, llvm::CodeGenOpt::Default,
+      llvm::CodeGenOpt::Aggressive};
+#endif
+  std::unique_ptr<llvm::TargetMachine> machine(target->createTargetMachine(
+      triple, llvm::sys::getHostCPUName(), features.getString(),
+      llvm::TargetOptions(), llvm::Reloc::PIC_, {}, levels[opt_level]));
+  if (!machine) {
+    std::cerr << "Error: failed to create target machine for " << triple
+              << '\n';
+    return nullptr;
+  }
+
+  module.setTargetTriple(triple);
+  module.setDataLayout(machine->createDataLayout());
+  return machine;
+}
+
+// Runs LLVM's standard -O<opt_level> pipeline over the module in-process
+void optimizeModule(llvm::Module &module, llvm::TargetMachine &machine,
+                    unsigned opt_level) {
+  llvm::LoopAnalysisManager loop_analyses;
+  llvm::FunctionAnalysisManager function_analyses;
+  llvm::CGSCCAnalysisManager cgscc_analyses;
+  llvm::ModuleAnalysisManager module_analyses;
+
+  llvm::PassBuilder pass_builder(&machine);
+  pass_builder.registerModuleAnalyses(module_analyses);
+  pass_builder.registerCGSCCAnalyses(cgscc_analyses);
+  pass_builder.registerFunctionAnalyses(function_analyses);
+  pass_builder.registerLoopAnalyses(loop_analyses);
+  pass_builder.crossRegisterProxies(loop_analyses, function_analyses,
+                                    cgscc_analyses, module_analyses);
+
+  const llvm::OptimizationLevel levels[] = {
+      llvm::OptimizationLevel::O0, llvm::OptimizationLevel::O1,
+      llvm::OptimizationLevel::O2, llvm::OptimizationLevel::O3};
+  llvm::ModulePassManager passes =
+      opt_level == 0
+          ? pass_builder.buildO0DefaultPipeline(llvm::OptimizationLevel::O0)
+          : pass_builder.buildPerModuleDefaultPipeline(levels[opt_level]);
+  passes.run(module, module_analyses);
+}
+
+// Writes the module as a native object file
+bool emitObject(llvm::Module &module, llvm::TargetMachine &machine,
+                const std::string &path) {
+  std::error_code error;
+  llvm::raw_fd_ostream out(path, error, llvm::sys::fs::OF_None);
+  if (error) {
+    std::cerr << "Failed to open file: " << path << '\n';
+    return false;
+  }
+
+#if LLVM_VERSION_MAJOR >= 18
+  const auto file_type = llvm::CodeGenFileType::ObjectFile;
+#else
+  const auto file_type = llvm::CGFT_ObjectFile;
+#endif
+  llvm::legacy::PassManager passes;
+  if (machine.addPassesToEmitFile(passes, out, nullptr, file_type)) {
+    std::cerr << "Error: target cannot emit object files\n";
+    return false;
+  }
+  passes.run(module);
+  out.flush();
+  return true;
+}
+
+// Splits the module into up to threads partitions, then optimizes and
+// compiles them on that many threads. Each partition is parsed into a
+// context of its own, as a context may only be used by one thread at a
+// time. Writes the objects to path.<n>.o and lists them in objects.
+bool emitObjectsInParallel(llvm::Module &module, unsigned opt_level,
+                           unsigned threads, const std::string &path,
+                           std::vector<std::string> &objects) {
+  std::vector<llvm::SmallString<0>> partitions;
+  llvm::SplitModule(module, threads,
+                    [&](std::unique_ptr<llvm::Module> partition) {
+                      partitions.emplace_back();
+                      llvm::raw_svector_ostream out(partitions.back());
+                      llvm::WriteBitcodeToFile(*partition, out);
+                    });
+  for (size_t i = 0; i < partitions.size(); ++i) {
+    objects.push_back(path + "." + std::to_string(i) + ".o");
+  }
+
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < partitions.size();) {
+      llvm::LLVMContext context;
+      auto partition = llvm::parseBitcodeFile(
+          llvm::MemoryBufferRef(partitions[i].str(), objects[i]), context);
+      if (!partition) {
+        llvm::consumeError(partition.takeError());
+        std::cerr << "Error: failed to read partition " << i << '\n';
+        failed = true;
+        continue;
+      }
+      std::unique_ptr<llvm::TargetMachine> machine =
+          createTargetMachine(**partition, opt_level);
+      if (!machine) {
+        failed = true;
+        continue;
+      }
+      optimizeModule(**partition, *machine, opt_level);
+      if (!emitObject(**partition, *machine, objects[i])) {
+        failed = true;
+      }
+    }
+  };
+  std::vector<std::thread> pool;
+  for (unsigned i = 1; i < threads && i < partitions.size(); ++i) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (std::thread &thread : pool) {
+    thread.join();
+  }
+  return !failed;
+}
+
+// Links object files into an executable, or a shared library, with the
+// system compiler driver
+bool linkObjects(const std::vector<std::string> &objects,
+                 const std::string &path, bool shared) {
+  const char *cc = std::getenv("CC");
+  std::string command = std::string(cc ? cc : "cc");
+  if (shared) {
+    command += " -shared";
+  }
+  for (const std::string &object : objects) {
+    command += " '" + object + "'";
+  }
+  command += " -o '" + path + "'";
+  if (std::system(command.c_str()) != 0) {
+    std::cerr << "Error: linking failed: " << command << '\n';
+    return false;
+  }
+  return true;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+double millisecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+// Compiles the module in-process with ORC's LLJIT and calls its main,
+// reporting compile and run time separately on stderr. compile_start is
+// when IR generation began, so compile time covers building the IR too.
+int runJit(std::unique_ptr<llvm::LLVMContext> context,
+           std::unique_ptr<llvm::Module> module,
+           Clock::time_point compile_start) {
+  auto jit = llvm::orc::LLJITBuilder().create();
+  if (!jit) {
+    std::cerr << "Error: failed to create JIT: "
+              << llvm::toString(jit.takeError()) << '\n';
+    return 1;
+  }
+
+  // Resolve putchar/getchar from the running process
+  llvm::orc::JITDylib &main_dylib = (*jit)->getMainJITDylib();
+  auto generator =
+      llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          (*jit)->getDataLayout().getGlobalPrefix());
+  if (!generator) {
+    std::cerr << "Error: failed to load process symbols: "
+              << llvm::toString(generator.takeError()) << '\n';
+    return 1;
+  }
+  main_dylib.addGenerator(std::move(*generator));
+
+  module->setDataLayout((*jit)->getDataLayout());
+  if (llvm::Error error = (*jit)->addIRModule(
+          llvm::orc::ThreadSafeModule(std::move(module), std::move(context)))) {
+    std::cerr << "Error: failed to add module: "
+              << llvm::toString(std::move(error)) << '\n';
+    return 1;
+  }
+
+  // LLJIT compiles the whole module on the first lookup
+  auto symbol = (*jit)->lookup("main");
+  if (!symbol) {
+    std::cerr << "Error: failed to compile: "
+              << llvm::toString(symbol.takeError()) << '\n';
+    return 1;
+  }
+#if LLVM_VERSION_MAJOR >= 15
+  auto *main_func = symbol->toPtr<int (*)()>();
+#else
+  auto *main_func =
+      reinterpret_cast<int (*)()>(static_cast<uintptr_t>(symbol->getAddress()));
+#endif
+  double compile_ms = millisecondsSince(compile_start);
+
+  Clock::time_point run_start = Clock::now();
+  int result = main_func();
+  std::fflush(stdout);
+  double run_ms = millisecondsSince(run_start);
+
+  std::cerr << "Compile time: " << compile_ms << " ms\n"
+            << "Run time: " << run_ms << " ms\n";
+  return result;
 }
 
 int main(int argc, char *argv[]) {
   // Read Brainfuck code from a file or standard input
   std::string code;
+  std::string filename;
   std::ifstream file;
+  std::string emit = "ll";
+  std::string output_path;
+  std::string profile_path;
+  size_t tape_size = sizeof(void *) >= 8 ? (size_t(1) << 30) : (64u << 20);
+  unsigned opt_level = 0;
+  unsigned threads = 1;
+  bool jit = false;
 
-  if (argc > 1) {
-    file.open(argv[1]);
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--jit") {
+      jit = true;
+    } else if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0 &&
+               arg[2] >= '0' && arg[2] <= '3') {
+      opt_level = arg[2] - '0';
+    } else if (arg.compare(0, 7, "--emit=") == 0) {
+      emit = arg.substr(7);
+      if (emit != "ll" && emit != "bc" && emit != "obj" && emit != "exe" &&
+          emit != "so") {
+        std::cerr << "Unknown --emit kind: " << emit
+                  << " (expected ll, bc, obj, exe or so)\n";
+        return 1;
+      }
+      library_mode |= emit == "so";
+    } else if (arg == "--library") {
+      library_mode = true;
+    } else if (arg.compare(0, 10, "--threads=") == 0) {
+      try {
+        threads = std::max(1, std::stoi(arg.substr(10)));
+      } catch (const std::exception &) {
+        std::cerr << "Invalid value for --threads\n";
+        return 1;
+      }
+    } else if (arg.compare(0, 12, "--tape-size=") == 0) {
+      try {
+        tape_size = std::stoull(arg.substr(12));
+      } catch (const std::exception &) {
+        std::cerr << "Invalid value for --tape-size\n";
+        return 1;
+      }
+    } else if (arg.compare(0, 10, "--profile=") == 0) {
+      profile_path = arg.substr(10);
+    } else if (arg == "-o" && i + 1 < argc) {
+      output_path = argv[++i];
+    } else {
+      filename = arg;
+    }
+  }
+
+  if (library_mode && (jit || emit == "exe")) {
+    std::cerr << "Error: bf_run cannot be used with --jit or --emit=exe\n";
+    return 1;
+  }
+
+  if (!filename.empty()) {
+    file.open(filename);
     if (!file) {
-      std::cerr << "Failed to open file: " << argv[1] << '\n';
+      std::cerr << "Failed to open file: " << filename << '\n';
       return 1;
     }
   }
 
-  std::istream &input = (argc > 1) ? file : std::cin;
+  std::istream &input = !filename.empty() ? file : std::cin;
 
   std::ostringstream oss;
   oss << input.rdbuf();
   code = oss.str();
 
   size_t index = 0;
+  size_t instruction_id = 0;
   std::vector<std::unique_ptr<Instruction>> instructions;
   try {
-    instructions = parse(code, index);
+    instructions = parse(code, index, instruction_id);
   } catch (const std::exception &e) {
     std::cerr << "Error while parsing: " << e.what() << '\n';
     return 1;
   }
 
-  // Optimize instructions
+  if (!profile_path.empty()) {
+    std::map<size_t, uint64_t> counts;
+    if (!readProfile(profile_path, counts)) {
+      return 1;
+    }
+    applyProfile(instructions, counts);
+  }
+
+  // Optimize instructions. Only linked output is split across threads: a
+  // relocatable object would export the partitions' shared symbols.
   optimizeInstructions(instructions);
+  bool split = threads > 1 && (emit == "exe" || emit == "so") && !jit;
+  if (split) {
+    outlineLoops(instructions);
+  }
 
   // Initialize LLVM
-  llvm::LLVMContext context;
-  llvm::Module module("brainfuck_module", context);
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  Clock::time_point compile_start = Clock::now();
+  auto context_owner = std::make_unique<llvm::LLVMContext>();
+  llvm::LLVMContext &context = *context_owner;
+  auto module_owner =
+      std::make_unique<llvm::Module>("brainfuck_module", context);
+  llvm::Module &module = *module_owner;
   llvm::IRBuilder<> builder(context);
 
-  // Create main function
-  llvm::FunctionType *main_type =
-      llvm::FunctionType::get(builder.getInt32Ty(), false);
-  llvm::Function *main_func = llvm::Function::Create(
-      main_type, llvm::Function::ExternalLinkage, "main", module);
-  llvm::BasicBlock *entry =
-      llvm::BasicBlock::Create(context, "entry", main_func);
-  builder.SetInsertPoint(entry);
+  // The runtime sizes buffers with the target's data layout
+  std::unique_ptr<llvm::TargetMachine> machine =
+      createTargetMachine(module, opt_level);
+  if (!machine) {
+    return 1;
+  }
 
-  // Create tape
-  llvm::ArrayType *tape_type = llvm::ArrayType::get(builder.getInt8Ty(), 30000);
-  llvm::Value *tape = builder.CreateAlloca(tape_type, nullptr, "tape");
-  builder.CreateMemSet(tape, builder.getInt8(0), 30000, llvm::MaybeAlign(1));
+  if (library_mode) {
+    llvm::Value *tape = beginRunFunction(builder, &module);
+    generateBlock(instructions, builder, tape, &module, context);
+    endRunFunction(builder, &module);
+  } else {
+    // Create main function
+    llvm::FunctionType *main_type =
+        llvm::FunctionType::get(builder.getInt32Ty(), false);
+    llvm::Function *main_func = llvm::Function::Create(
+        main_type, llvm::Function::ExternalLinkage, "main", module);
+    llvm::BasicBlock *entry =
+        llvm::BasicBlock::Create(context, "entry", main_func);
+    builder.SetInsertPoint(entry);
 
-  // Create pointer to the tape (start at tape[0])
-  llvm::Value *ptr = builder.CreateInBoundsGEP(
-      tape_type, tape, {builder.getInt32(0), builder.getInt32(0)}, "ptr");
-  llvm::Value *tape_ptr = builder.CreateAlloca(
-      builder.getInt8Ty()->getPointerTo(), nullptr, "tape_ptr");
-  builder.CreateStore(ptr, tape_ptr);
+    // Create the tape. Generated code only touches cells the program itself
+    // touches, and no folded move reaches further than the program has '<'
+    // and '>', which bounds how far past the tape an overrun can get before
+    // it faults.
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t moves = std::count(code.begin(), code.end(), '>') +
+                   std::count(code.begin(), code.end(), '<');
+    uint64_t tape_bytes = (tape_size + page - 1) / page * page;
+    uint64_t margin = (moves / page + 1) * page;
+    llvm::Value *tape = allocateTape(builder, &module, tape_bytes, margin);
+    generateBlock(instructions, builder, tape, &module, context);
 
-  for (const auto &instr : instructions) {
-    instr->generateCode(builder, tape_ptr, &module, context);
+    // Flush buffered output and return 0 at the end
+    excludeTape(builder.CreateCall(getFlushFunction(&module)));
+    freeTape(builder, &module, tape, tape_bytes, margin);
+    builder.CreateRet(builder.getInt32(0));
   }
 
-  // Return 0 at the end
-  builder.CreateRet(builder.getInt32(0));
-
   // Verify the IR generated
   if (llvm::verifyModule(module, &llvm::errs())) {
     std::cerr << "Error: module verification failed\n";
     return 1;
   }
 
-  module.print(llvm::outs(), nullptr);
+  std::string linked_path = output_path;
+  if (linked_path.empty()) {
+    linked_path = emit == "so" ? "output.so" : "output";
+  }
+  if (split) {
+    std::vector<std::string> objects;
+    bool linked =
+        emitObjectsInParallel(module, opt_level, threads, linked_path,
+                              objects) &&
+        linkObjects(objects, linked_path, emit == "so");
+    for (const std::string &object : objects) {
+      std::remove(object.c_str());
+    }
+    return linked ? 0 : 1;
+  }
+
+  optimizeModule(module, *machine, opt_level);
+
+  if (jit) {
+    return runJit(std::move(context_owner), std::move(module_owner),
+                  compile_start);
+  }
+
+  if (emit == "obj") {
+    return emitObject(module, *machine,
+                      output_path.empty() ? "output.o" : output_path)
+               ? 0
+               : 1;
+  }
+  if (emit == "exe" || emit == "so") {
+    std::string object_path = linked_path + ".tmp.o";
+    bool linked = emitObject(module, *machine, object_path) &&
+                  linkObjects({object_path}, linked_path, emit == "so");
+    std::remove(object_path.c_str());
+    return linked ? 0 : 1;
+  }
+
+  // Textual IR or bitcode, to stdout unless -o is given
+  std::unique_ptr<llvm::raw_fd_ostream> file_out;
+  if (!output_path.empty()) {
+    std::error_code error;
+    file_out = std::make_unique<llvm::raw_fd_ostream>(output_path, error,
+                                                      llvm::sys::fs::OF_None);
+    if (error) {
+      std::cerr << "Failed to open file: " << output_path << '\n';
+      return 1;
+    }
+  }
+  llvm::raw_ostream &out = file_out ? *file_out : llvm::outs();
+  if (emit == "bc") {
+    llvm::WriteBitcodeToFile(module, out);
+  } else {
+    module.print(out, nullptr);
+  }
 
   return 0;
 }
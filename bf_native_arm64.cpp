@@ -1,6 +1,8 @@
 #include <algorithm>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <stdexcept>
@@ -8,13 +10,215 @@
 #include <unordered_map>
 #include <vector>
 
+#include <sys/stat.h>
+
+// Generates ARM64 assembly for macOS (Darwin), or encodes the same
+// instructions itself and writes an AArch64 Linux ELF object or executable
+// directly. The data pointer lives in X19 and the tape mapping in X20, both
+// callee-saved, so calls to libc leave them alone.
+
 bool optimize_simple_loops = false;
 bool optimize_memory_scans = false;
+bool optimize_blocks = false;
+
+// Where the tape lies in the mapping at X20, as byte offsets of its first
+// cell and of the end of its last. Set by main once the tape is sized;
+// memory scans stop at them.
+uint64_t tape_begin_offset = 0;
+uint64_t tape_end_offset = 0;
+
+// Loads a 64-bit immediate into reg, 16 bits at a time
+void emitMoveImmediate(std::ostream &output, const std::string &reg,
+                       uint64_t value) {
+  output << "\tMOVZ " << reg << ", #" << (value & 0xFFFF) << "\n";
+  for (int shift = 16; shift < 64; shift += 16) {
+    uint64_t chunk = (value >> shift) & 0xFFFF;
+    if (chunk != 0) {
+      output << "\tMOVK " << reg << ", #" << chunk << ", LSL #" << shift
+             << "\n";
+    }
+  }
+}
+
+// Output buffer of encoded programs, which call no libc to buffer for them
+const uint32_t output_buffer_size = 1 << 16;
+
+// Machine code under construction. Branches and ADR refer to labels with
+// PC-relative immediates, patched once the code is complete.
+class Encoder {
+public:
+  std::vector<uint8_t> code;
+  int flush_label = -1; // Runtime routines that instructions call
+  int input_label = -1;
+
+  int newLabel() {
+    labels.push_back(-1);
+    return static_cast<int>(labels.size() - 1);
+  }
+  void bind(int label) { bind(label, code.size()); }
+  void bind(int label, size_t offset) {
+    labels[label] = static_cast<int64_t>(offset);
+  }
+
+  void emit(uint32_t instruction) {
+    for (int i = 0; i < 4; ++i) {
+      code.push_back(static_cast<uint8_t>(instruction >> (8 * i)));
+    }
+  }
+  // B, BL, B.cond, CBZ, CBNZ or ADR with every field but the offset of label
+  void emitBranch(uint32_t instruction, int label) {
+    fixups.emplace_back(code.size(), label);
+    emit(instruction);
+  }
+  // Pads with zeroes to the next instruction
+  void align() {
+    while (code.size() % 4 != 0) {
+      code.push_back(0);
+    }
+  }
+
+  void resolve() {
+    for (const auto &fixup : fixups) {
+      int64_t target = labels[fixup.second];
+      if (target < 0) {
+        throw std::runtime_error("Reference to an unbound label");
+      }
+      int64_t distance = target - static_cast<int64_t>(fixup.first);
+      uint32_t instruction = 0;
+      for (int i = 0; i < 4; ++i) {
+        instruction |= static_cast<uint32_t>(code[fixup.first + i]) << (8 * i);
+      }
+      if ((instruction & 0x9F000000) == 0x10000000) { // ADR
+        checkRange(distance, 21);
+        instruction |= (static_cast<uint32_t>(distance) & 3) << 29 |
+                       (static_cast<uint32_t>(distance >> 2) & 0x7FFFF) << 5;
+      } else if ((instruction & 0x7C000000) == 0x14000000) { // B, BL
+        checkRange(distance / 4, 26);
+        instruction |= static_cast<uint32_t>(distance / 4) & 0x3FFFFFF;
+      } else { // B.cond, CBZ, CBNZ
+        checkRange(distance / 4, 19);
+        instruction |= (static_cast<uint32_t>(distance / 4) & 0x7FFFF) << 5;
+      }
+      for (int i = 0; i < 4; ++i) {
+        code[fixup.first + i] = static_cast<uint8_t>(instruction >> (8 * i));
+      }
+    }
+  }
+
+private:
+  std::vector<int64_t> labels;
+  std::vector<std::pair<size_t, int>> fixups;
+
+  static void checkRange(int64_t value, int bits) {
+    if (value < -(int64_t(1) << (bits - 1)) ||
+        value >= int64_t(1) << (bits - 1)) {
+      throw std::runtime_error("Branch out of range");
+    }
+  }
+};
+
+// A64 instruction words. Register 31 is SP as the base of loads and stores
+// and in ADD and SUB (immediate), and XZR or WZR everywhere else.
+const uint32_t a64_b = 0x14000000, a64_bl = 0x94000000;
+const int cond_eq = 0, cond_ne = 1, cond_hs = 2, cond_lo = 3, cond_hi = 8,
+          cond_le = 13;
+
+// ADD, or SUB if value is negative, of a 12-bit immediate, optionally
+// shifted left by 12
+uint32_t addImmediate(int rd, int rn, int64_t value, bool wide = true) {
+  uint32_t instruction = (wide ? 0x91000000 : 0x11000000) |
+                         (value < 0 ? 0x40000000 : 0);
+  uint64_t magnitude = value < 0 ? -value : value;
+  if (magnitude >= 4096) {
+    if (magnitude % 4096 != 0 || magnitude >= 4096 * 4096) {
+      throw std::runtime_error("Immediate out of range");
+    }
+    instruction |= 1 << 22;
+    magnitude >>= 12;
+  }
+  return instruction | static_cast<uint32_t>(magnitude) << 10 | rn << 5 | rd;
+}
+
+// CMP, or CMN if value is negative, of Xn with an immediate
+uint32_t compareImmediate(int rn, int64_t value) {
+  return addImmediate(31, rn, -value) | 0x20000000;
+}
+
+// ADD or SUB (shifted register), with Rm shifted right by lsr
+uint32_t addRegister(int rd, int rn, int rm, bool subtract = false,
+                     bool wide = true, int lsr = 0) {
+  return (wide ? 0x8B000000 : 0x0B000000) | (subtract ? 0x40000000 : 0) |
+         (lsr ? 1 << 22 | lsr << 10 : 0) | rm << 16 | rn << 5 | rd;
+}
+
+// CMP Xn, Xm
+uint32_t compareRegister(int rn, int rm) {
+  return 0xEB00001F | rm << 16 | rn << 5;
+}
+
+// MOV (register), which cannot copy SP
+uint32_t moveRegister(int rd, int rm, bool wide = true) {
+  return (wide ? 0xAA0003E0 : 0x2A0003E0) | rm << 16 | rd;
+}
+
+// MOVZ, or MOVK to keep the other bits, of a 16-bit chunk at shift
+uint32_t moveWide(int rd, uint32_t chunk, int shift = 0, bool keep = false) {
+  return 0xD2800000 | (keep ? 0x20000000 : 0) | (shift / 16) << 21 |
+         chunk << 5 | rd;
+}
+
+// LDRB or STRB at offset: scaled up to 4095, unscaled (LDURB or STURB)
+// down to -256
+uint32_t loadStoreByte(bool load, int rt, int rn, int offset) {
+  uint32_t instruction = load ? 0x00400000 : 0;
+  if (offset >= 0 && offset < 4096) {
+    return instruction | 0x39000000 | offset << 10 | rn << 5 | rt;
+  }
+  if (offset >= -256 && offset < 0) {
+    return instruction | 0x38000000 | (offset & 0x1FF) << 12 | rn << 5 | rt;
+  }
+  throw std::runtime_error("Cell offset out of range");
+}
+
+// B.cond, CBZ or CBNZ, and ADR, for emitBranch
+uint32_t branchIf(int cond) { return 0x54000000 | cond; }
+uint32_t compareBranch(int rt, bool nonzero, bool wide = false) {
+  return (wide ? 0xB4000000 : 0x34000000) | (nonzero ? 1 << 24 : 0) | rt;
+}
+uint32_t adr(int rd) { return 0x10000000 | rd; }
+
+// STP Xt, Xt2, [SP, #-16]! and LDP Xt, Xt2, [SP], #16
+uint32_t pushPair(int rt, int rt2) { return 0xA9BF03E0 | rt2 << 10 | rt; }
+uint32_t popPair(int rt, int rt2) { return 0xA8C103E0 | rt2 << 10 | rt; }
+
+// Loads a 64-bit immediate into Xreg, 16 bits at a time
+void encodeMoveImmediate(Encoder &code, int reg, uint64_t value) {
+  code.emit(moveWide(reg, value & 0xFFFF));
+  for (int shift = 16; shift < 64; shift += 16) {
+    uint32_t chunk = (value >> shift) & 0xFFFF;
+    if (chunk != 0) {
+      code.emit(moveWide(reg, chunk, shift, true));
+    }
+  }
+}
+
+// Appends Wreg to the output buffer at X16, holding X17 bytes, and flushes
+// the buffer once it is full. Nothing else uses X16 and X17.
+void encodeOutput(Encoder &code, int reg) {
+  int skip = code.newLabel();
+  code.emit(0x38316A00 | reg); // STRB Wreg, [X16, X17]
+  code.emit(addImmediate(17, 17, 1));
+  code.emit(compareImmediate(17, output_buffer_size));
+  code.emitBranch(branchIf(cond_ne), skip);
+  code.emitBranch(a64_bl, code.flush_label);
+  code.bind(skip);
+}
 
 class Instruction {
 public:
   virtual ~Instruction() = default;
   virtual void execute(std::ostream &output, int &label_counter) = 0;
+  virtual void encode(Encoder &code) = 0;
   virtual bool isLoop() const { return false; }
   virtual bool isIO() const { return false; }
   virtual std::unique_ptr<Instruction> optimize() { return nullptr; }
@@ -25,6 +229,7 @@ public:
   void execute(std::ostream &output, int & /*label_counter*/) override {
     output << "\tADD X19, X19, #1\n";
   }
+  void encode(Encoder &code) override { code.emit(addImmediate(19, 19, 1)); }
 };
 
 class DecrementDataPointer : public Instruction {
@@ -32,6 +237,7 @@ public:
   void execute(std::ostream &output, int & /*label_counter*/) override {
     output << "\tSUB X19, X19, #1\n";
   }
+  void encode(Encoder &code) override { code.emit(addImmediate(19, 19, -1)); }
 };
 
 class IncrementByte : public Instruction {
@@ -41,6 +247,11 @@ public:
     output << "\tADD W1, W1, #1\n";
     output << "\tSTRB W1, [X19]\n";
   }
+  void encode(Encoder &code) override {
+    code.emit(loadStoreByte(true, 1, 19, 0));
+    code.emit(addImmediate(1, 1, 1, false));
+    code.emit(loadStoreByte(false, 1, 19, 0));
+  }
 };
 
 class DecrementByte : public Instruction {
@@ -50,6 +261,11 @@ public:
     output << "\tSUB W1, W1, #1\n";
     output << "\tSTRB W1, [X19]\n";
   }
+  void encode(Encoder &code) override {
+    code.emit(loadStoreByte(true, 1, 19, 0));
+    code.emit(addImmediate(1, 1, -1, false));
+    code.emit(loadStoreByte(false, 1, 19, 0));
+  }
 };
 
 class OutputByte : public Instruction {
@@ -58,6 +274,10 @@ public:
     output << "\tLDRB W0, [X19]\n";
     output << "\tBL _putchar\n";
   }
+  void encode(Encoder &code) override {
+    code.emit(loadStoreByte(true, 0, 19, 0));
+    encodeOutput(code, 0);
+  }
   bool isIO() const override { return true; }
 };
 
@@ -67,6 +287,10 @@ public:
     output << "\tBL _getchar\n";
     output << "\tSTRB W0, [X19]\n";
   }
+  void encode(Encoder &code) override {
+    code.emitBranch(a64_bl, code.input_label);
+    code.emit(loadStoreByte(false, 0, 19, 0));
+  }
   bool isIO() const override { return true; }
 };
 
@@ -75,9 +299,16 @@ public:
   std::unordered_map<int, int> cell_changes; // cell offset to change
   OptimizedSimpleLoop(const std::unordered_map<int, int> &changes)
       : cell_changes(changes) {}
-  void execute(std::ostream &output, int & /*label_counter*/) override {
-    // Load p[0] into W0
+  void execute(std::ostream &output, int &label_counter) override {
+    // Load the iteration count into W0: p[0] if the loop counts p[0] down,
+    // 256 - p[0], the same as -p[0] in the bytes stored, if it counts up.
+    // A loop that does not run touches none of its cells.
+    int skip_label = label_counter++;
     output << "\tLDRB W0, [X19]\n";
+    output << "\tCBZ W0, L" << skip_label << "\n";
+    if (cell_changes.at(0) > 0) {
+      output << "\tNEG W0, W0\n";
+    }
     // For each cell offset, apply the changes
     for (const auto &pair : cell_changes) {
       int offset = pair.first;
@@ -109,53 +340,374 @@ public:
     // Set p[0] to 0
     output << "\tMOV W1, #0\n";
     output << "\tSTRB W1, [X19]\n";
+    output << "L" << skip_label << ":\n";
+  }
+  void encode(Encoder &code) override {
+    int skip = code.newLabel();
+    code.emit(loadStoreByte(true, 0, 19, 0));
+    code.emitBranch(compareBranch(0, false), skip);
+    if (cell_changes.at(0) > 0) {
+      code.emit(0x4B0003E0); // NEG W0, W0
+    }
+    for (const auto &pair : cell_changes) {
+      int offset = pair.first;
+      int change = pair.second;
+      if (offset == 0 || change == 0)
+        continue;
+      code.emit(loadStoreByte(true, 1, 19, offset));
+      if (change == 1 || change == -1) {
+        code.emit(addRegister(1, 1, 0, change < 0, false));
+      } else {
+        encodeMoveImmediate(code, 2, std::abs(change));
+        code.emit(0x1B027C02); // MUL W2, W0, W2
+        code.emit(addRegister(1, 1, 2, change < 0, false));
+      }
+      code.emit(loadStoreByte(false, 1, 19, offset));
+    }
+    code.emit(loadStoreByte(false, 31, 19, 0)); // STRB WZR, [X19]
+    code.bind(skip);
   }
 };
 
+// Moves the pointer by stride until it reaches a zero cell. Vector blocks
+// stay within the tape: near its ends, and for strides over 8, which visit
+// too few cells per vector to be worth it, the scan tests one cell at a time.
 class OptimizedMemoryScan : public Instruction {
 public:
-  int direction; // +1 for '>', -1 for '<'
-  OptimizedMemoryScan(int dir) : direction(dir) {}
+  int stride; // Net pointer movement per iteration, negative for '<'
+  OptimizedMemoryScan(int s) : stride(s) {}
   void execute(std::ostream &output, int &label_counter) override {
     int loop_label = label_counter++;
     int found_label = label_counter++;
-    int not_found_label = label_counter++;
+    int tail_label = label_counter++;
+    int done_label = label_counter++;
+    bool forward = stride > 0;
+    int step = std::abs(stride);
+    std::string advance = forward ? "ADD" : "SUB";
 
-    // Set the scan direction
-    std::string direction_instr = (direction == 1) ? "ADD" : "SUB";
-    std::string offset = (direction == 1) ? "#16" : "#-16";
+    // Each block loads 16, 32 or 64 bytes, de-interleaving with LD2/LD4 so
+    // that one register holds the cells the scan visits. A stride of 8 keeps
+    // every other lane of the LD4 register. Backward scans load the block
+    // that ends at the current cell and take the last register instead.
+    int regs = step == 1 ? 1 : step == 2 ? 2 : 4;
+    int block = 16 * regs;
+    int vector = forward ? 0 : regs - 1;
+    std::string base = forward ? "X19" : "X9";
 
     output << "\t// Optimized Memory Scan\n";
-    output << "L" << loop_label << ":\n";
-    output << "\t// Load 16 bytes into vector register V0\n";
-    output << "\tLD1 {V0.16B}, [X19]\n";
-    output << "\t// Compare bytes in V0 with zero\n";
-    output << "\tCMEQ V1.16B, V0.16B, #0\n";
-    output << "\t// Create index vector {0,1,...,15}\n";
-    output << "\tMOVI V2.16B, #0\n";
-    output << "\tADDV B2, V2.16B\n";
-    output << "\t// Mask indices where zero is found\n";
-    output << "\tBIC V3.16B, V2.16B, V1.16B\n";
-    output << "\t// Find the minimum index\n";
-    output << "\tUMINV B3, V3.16B\n";
-    output << "\t// Move the value from vector register B3 to general-purpose "
-              "register W3\n";
-    output << "\tUMOV W3, V3.B[0]\n";
-
-    output << "\t//Extend W3 into a 64-bit register\n";
-    output << "\tUXTW X3, W3\n ";
-
-    output << "\t// Check if zero was found\n";
-    output << "\tCMP W3, #255\n"; // 255 indicates no zero found
-    output << "\tB.EQ L" << not_found_label << "\n";
-    output << "\t// Zero found, adjust pointer\n";
-    output << "\tADD X19, X19, X3\n";
-    output << "\tB L" << found_label << "\n";
-    output << "L" << not_found_label << ":\n";
-    output << "\t// Move pointer and repeat\n";
-    output << "\t" << direction_instr << " X19, X19, " << offset << "\n";
-    output << "\tB L" << loop_label << "\n";
-    output << "L" << found_label << ":\n";
+    if (step <= 8) {
+      // X10 is the last position a whole block still fits in the tape from
+      uint64_t limit = forward ? tape_end_offset - block
+                               : tape_begin_offset + block - 1;
+      emitMoveImmediate(output, "X10", limit);
+      output << "\tADD X10, X20, X10\n";
+      output << "L" << loop_label << ":\n";
+      output << "\tCMP X19, X10\n";
+      output << "\tB." << (forward ? "HI" : "LO") << " L" << tail_label
+             << "\n";
+      if (!forward) {
+        output << "\tSUB X9, X19, #" << block - 1 << "\n";
+      }
+      if (regs == 1) {
+        output << "\tLD1 {V0.16B}, [" << base << "]\n";
+      } else {
+        output << "\tLD" << regs << " {";
+        for (int i = 0; i < regs; ++i) {
+          output << (i ? ", " : "") << "V" << i << ".16B";
+        }
+        output << "}, [" << base << "]\n";
+      }
+      output << "\tCMEQ V" << vector << ".16B, V" << vector << ".16B, #0\n";
+      // Narrow the 0x00/0xFF lanes to a 64-bit mask with 4 bits per lane
+      output << "\tSHRN V4.8B, V" << vector << ".8H, #4\n";
+      output << "\tFMOV X9, D4\n";
+      if (step == 8) {
+        output << "\tAND X9, X9, #"
+               << (forward ? "0x0F0F0F0F0F0F0F0F" : "0xF0F0F0F0F0F0F0F0")
+               << "\n";
+      }
+      output << "\tCBNZ X9, L" << found_label << "\n";
+      output << "\t" << advance << " X19, X19, #" << block << "\n";
+      output << "\tB L" << loop_label << "\n";
+    }
+
+    output << "L" << tail_label << ":\n";
+    output << "\tLDRB W9, [X19]\n";
+    output << "\tCBZ W9, L" << done_label << "\n";
+    output << "\t" << advance << " X19, X19, #" << step << "\n";
+    output << "\tB L" << tail_label << "\n";
+
+    if (step <= 8) {
+      // The first set bit (last one going backward) is 4 * lane, and lanes
+      // of one register are regs bytes apart
+      int shift = regs == 1 ? 2 : regs == 2 ? 1 : 0;
+      output << "L" << found_label << ":\n";
+      if (forward) {
+        output << "\tRBIT X9, X9\n";
+      }
+      output << "\tCLZ X9, X9\n";
+      output << "\t" << advance << " X19, X19, X9";
+      if (shift) {
+        output << ", LSR #" << shift;
+      }
+      output << "\n";
+    }
+    output << "L" << done_label << ":\n";
+  }
+
+  void encode(Encoder &code) override {
+    int loop_label = code.newLabel();
+    int found_label = code.newLabel();
+    int tail_label = code.newLabel();
+    int done_label = code.newLabel();
+    bool forward = stride > 0;
+    int step = std::abs(stride);
+    int regs = step == 1 ? 1 : step == 2 ? 2 : 4;
+    int block = 16 * regs;
+    int vector = forward ? 0 : regs - 1;
+    int base = forward ? 19 : 9;
+
+    if (step <= 8) {
+      encodeMoveImmediate(code, 10, forward ? tape_end_offset - block
+                                            : tape_begin_offset + block - 1);
+      code.emit(addRegister(10, 20, 10));
+      code.bind(loop_label);
+      code.emit(compareRegister(19, 10));
+      code.emitBranch(branchIf(forward ? cond_hi : cond_lo), tail_label);
+      if (!forward) {
+        code.emit(addImmediate(9, 19, -(block - 1)));
+      }
+      // LD1, LD2 or LD4 {V0.16B, ...}, [base]
+      code.emit((regs == 1 ? 0x4C407000 : regs == 2 ? 0x4C408000 : 0x4C400000) |
+                base << 5);
+      code.emit(0x4E209800 | vector << 5 | vector); // CMEQ Vv.16B, Vv.16B, #0
+      code.emit(0x0F0C8404 | vector << 5);          // SHRN V4.8B, Vv.8H, #4
+      code.emit(0x9E660089);                        // FMOV X9, D4
+      if (step == 8) {
+        // AND X9, X9, #0x0F0F0F0F0F0F0F0F or #0xF0F0F0F0F0F0F0F0
+        code.emit(forward ? 0x9200CD29 : 0x9204CD29);
+      }
+      code.emitBranch(compareBranch(9, true, true), found_label);
+      code.emit(addImmediate(19, 19, forward ? block : -block));
+      code.emitBranch(a64_b, loop_label);
+    }
+
+    code.bind(tail_label);
+    code.emit(loadStoreByte(true, 9, 19, 0));
+    code.emitBranch(compareBranch(9, false), done_label);
+    code.emit(addImmediate(19, 19, stride));
+    code.emitBranch(a64_b, tail_label);
+
+    if (step <= 8) {
+      int shift = regs == 1 ? 2 : regs == 2 ? 1 : 0;
+      code.bind(found_label);
+      if (forward) {
+        code.emit(0xDAC00129); // RBIT X9, X9
+      }
+      code.emit(0xDAC01129); // CLZ X9, X9
+      code.emit(addRegister(19, 19, 9, !forward, true, shift));
+    }
+    code.bind(done_label);
+  }
+};
+
+// A straight-line run of '+', '-', '<', '>', '.' and ','. Increments and
+// pointer moves are folded at compile time and applied to each cell once,
+// cells that are read are kept in X21-X28, which survive the calls to
+// putchar and getchar, and dirty cells are written back when the block ends.
+class BasicBlock : public Instruction {
+public:
+  std::vector<std::unique_ptr<Instruction>> instructions;
+
+  void execute(std::ostream &output, int & /*label_counter*/) override {
+    text = &output;
+    code = nullptr;
+    generate();
+  }
+  void encode(Encoder &encoder) override {
+    text = nullptr;
+    code = &encoder;
+    generate();
+  }
+
+private:
+  struct Cell {
+    int reg = -1;   // Register holding the cell, if it has been read
+    int delta = 0;  // Change not yet applied to the register or memory
+    bool dirty = false;
+  };
+  std::map<int, Cell> cells;     // Cells touched, by offset from X19
+  std::vector<int> loaded;       // Offsets of cells in registers, oldest first
+  std::vector<int> free_registers;
+  std::ostream *text = nullptr;  // Where the block goes, as assembly,
+  Encoder *code = nullptr;       // or as machine code
+
+  void generate() {
+    cells.clear();
+    loaded.clear();
+    free_registers = {28, 27, 26, 25, 24, 23, 22, 21};
+    int pointer = 0; // Offset of the data pointer from X19
+
+    for (const auto &instr : instructions) {
+      if (dynamic_cast<const IncrementDataPointer *>(instr.get())) {
+        pointer += 1;
+      } else if (dynamic_cast<const DecrementDataPointer *>(instr.get())) {
+        pointer -= 1;
+      } else if (dynamic_cast<const IncrementByte *>(instr.get())) {
+        cells[pointer].delta += 1;
+      } else if (dynamic_cast<const DecrementByte *>(instr.get())) {
+        cells[pointer].delta -= 1;
+      } else if (dynamic_cast<const OutputByte *>(instr.get())) {
+        emitOutput(materialize(pointer));
+      } else if (dynamic_cast<const InputByte *>(instr.get())) {
+        emitInput();
+        Cell &cell = cells[pointer];
+        if (cell.reg < 0) {
+          cell.reg = allocate();
+          loaded.push_back(pointer);
+        }
+        emitMove(cell.reg, 0);
+        cell.delta = 0;
+        cell.dirty = true;
+      }
+
+      // Keep offsets within LDURB's signed 9-bit immediate
+      if (pointer < -256 || pointer > 255) {
+        writeBack();
+        movePointer(pointer);
+        pointer = 0;
+      }
+    }
+
+    writeBack();
+    movePointer(pointer);
+  }
+
+  // The instructions the block is made of, in either form
+  static std::string address(int offset) {
+    if (offset == 0) {
+      return "[X19]";
+    }
+    return "[X19, #" + std::to_string(offset) + "]";
+  }
+  void emitLoad(int reg, int offset) {
+    if (code) {
+      code->emit(loadStoreByte(true, reg, 19, offset));
+    } else {
+      *text << "\tLDRB W" << reg << ", " << address(offset) << "\n";
+    }
+  }
+  void emitStore(int reg, int offset) {
+    if (code) {
+      code->emit(loadStoreByte(false, reg, 19, offset));
+    } else {
+      *text << "\tSTRB W" << reg << ", " << address(offset) << "\n";
+    }
+  }
+  void emitAdd(int reg, int delta) {
+    if (code) {
+      code->emit(addImmediate(reg, reg, delta, false));
+    } else {
+      *text << "\tADD W" << reg << ", W" << reg << ", #" << delta << "\n";
+    }
+  }
+  void emitMove(int reg, int source) {
+    if (code) {
+      code->emit(moveRegister(reg, source, false));
+    } else {
+      *text << "\tMOV W" << reg << ", W" << source << "\n";
+    }
+  }
+  void emitOutput(int reg) {
+    if (code) {
+      encodeOutput(*code, reg);
+    } else {
+      *text << "\tMOV W0, W" << reg << "\n";
+      *text << "\tBL _putchar\n";
+    }
+  }
+  // Leaves the byte read in W0
+  void emitInput() {
+    if (code) {
+      code->emitBranch(a64_bl, code->input_label);
+    } else {
+      *text << "\tBL _getchar\n";
+    }
+  }
+  void movePointer(int pointer) {
+    if (pointer == 0) {
+      return;
+    }
+    if (code) {
+      code->emit(addImmediate(19, 19, pointer));
+    } else if (pointer > 0) {
+      *text << "\tADD X19, X19, #" << pointer << "\n";
+    } else {
+      *text << "\tSUB X19, X19, #" << -pointer << "\n";
+    }
+  }
+
+  // Stores a cell if it differs from memory. Cells that were never read go
+  // through W1.
+  void store(int offset, Cell &cell) {
+    int delta = (cell.delta % 256 + 256) % 256;
+    if (cell.reg < 0) {
+      if (delta != 0) {
+        emitLoad(1, offset);
+        emitAdd(1, delta);
+        emitStore(1, offset);
+      }
+    } else {
+      if (delta != 0) {
+        emitAdd(cell.reg, delta);
+      }
+      if (delta != 0 || cell.dirty) {
+        emitStore(cell.reg, offset);
+      }
+    }
+    cell.delta = 0;
+    cell.dirty = false;
+  }
+
+  void writeBack() {
+    for (auto &pair : cells) {
+      store(pair.first, pair.second);
+    }
+    cells.clear();
+    loaded.clear();
+    free_registers = {28, 27, 26, 25, 24, 23, 22, 21};
+  }
+
+  // Takes a free register, evicting the cell loaded first if there is none
+  int allocate() {
+    if (free_registers.empty()) {
+      int offset = loaded.front();
+      loaded.erase(loaded.begin());
+      Cell &cell = cells[offset];
+      store(offset, cell);
+      free_registers.push_back(cell.reg);
+      cells.erase(offset);
+    }
+    int reg = free_registers.back();
+    free_registers.pop_back();
+    return reg;
+  }
+
+  // Returns the register holding the current value of a cell
+  int materialize(int offset) {
+    Cell &cell = cells[offset];
+    if (cell.reg < 0) {
+      cell.reg = allocate();
+      loaded.push_back(offset);
+      emitLoad(cell.reg, offset);
+    }
+    int delta = (cell.delta % 256 + 256) % 256;
+    if (delta != 0) {
+      emitAdd(cell.reg, delta);
+      cell.dirty = true;
+    }
+    cell.delta = 0;
+    return cell.reg;
   }
 };
 
@@ -183,6 +735,19 @@ public:
     output << "L" << end_label << ":\n";
   }
 
+  void encode(Encoder &code) override {
+    int start_label = code.newLabel();
+    int end_label = code.newLabel();
+    code.bind(start_label);
+    code.emit(loadStoreByte(true, 1, 19, 0));
+    code.emitBranch(compareBranch(1, false), end_label);
+    for (const auto &instr : instructions) {
+      instr->encode(code);
+    }
+    code.emitBranch(a64_b, start_label);
+    code.bind(end_label);
+  }
+
   std::unique_ptr<Instruction> optimize() override {
     // First, optimize inner loops recursively
     optimizeInstructions(instructions);
@@ -193,8 +758,7 @@ public:
       std::unordered_map<int, int> cell_changes = getCellChanges();
       return std::make_unique<OptimizedSimpleLoop>(cell_changes);
     } else if (optimize_memory_scans && canOptimizeMemoryScan()) {
-      int direction = getMemoryScanDirection();
-      return std::make_unique<OptimizedMemoryScan>(direction);
+      return std::make_unique<OptimizedMemoryScan>(getMemoryScanStride());
     }
     // No optimization possible; return nullptr
     return nullptr;
@@ -263,12 +827,12 @@ private:
     if (pointer == 0) {
       return false; // Net pointer movement is zero
     }
-    // Check if net pointer movement is a power of 2
+    // Check if net pointer movement is a power of 2 that fits ADD's immediate
     int abs_pointer = std::abs(pointer);
-    return (abs_pointer & (abs_pointer - 1)) == 0;
+    return abs_pointer <= 2048 && (abs_pointer & (abs_pointer - 1)) == 0;
   }
 
-  int getMemoryScanDirection() const {
+  int getMemoryScanStride() const {
     int pointer = 0;
     for (const auto &instr : instructions) {
       if (dynamic_cast<const IncrementDataPointer *>(instr.get())) {
@@ -277,7 +841,7 @@ private:
         pointer -= 1;
       }
     }
-    return (pointer > 0) ? 1 : -1;
+    return pointer;
   }
 };
 
@@ -298,6 +862,38 @@ void optimizeInstructions(
   }
 }
 
+// Groups runs of '+', '-', '<', '>', '.' and ',' into BasicBlocks. Runs
+// after optimizeInstructions, which looks for the plain commands.
+void formBasicBlocks(std::vector<std::unique_ptr<Instruction>> &instructions) {
+  std::vector<std::unique_ptr<Instruction>> grouped;
+  std::unique_ptr<BasicBlock> block;
+  for (auto &instr : instructions) {
+    if (auto loop = dynamic_cast<Loop *>(instr.get())) {
+      formBasicBlocks(loop->instructions);
+    }
+    Instruction *plain = instr.get();
+    if (dynamic_cast<IncrementDataPointer *>(plain) ||
+        dynamic_cast<DecrementDataPointer *>(plain) ||
+        dynamic_cast<IncrementByte *>(plain) ||
+        dynamic_cast<DecrementByte *>(plain) ||
+        dynamic_cast<OutputByte *>(plain) || dynamic_cast<InputByte *>(plain)) {
+      if (!block) {
+        block = std::make_unique<BasicBlock>();
+      }
+      block->instructions.push_back(std::move(instr));
+      continue;
+    }
+    if (block) {
+      grouped.push_back(std::move(block));
+    }
+    grouped.push_back(std::move(instr));
+  }
+  if (block) {
+    grouped.push_back(std::move(block));
+  }
+  instructions = std::move(grouped);
+}
+
 // Parsing function
 std::vector<std::unique_ptr<Instruction>> parse(const std::string &code,
                                                 size_t &index) {
@@ -340,7 +936,388 @@ std::vector<std::unique_ptr<Instruction>> parse(const std::string &code,
   return instructions;
 }
 
-bool parseArguments(int argc, char *argv[], std::string &filename) {
+// Maps the tape between two PROT_NONE guard regions of margin bytes; the
+// kernel zeroes pages lazily, on first touch. Leaves the first cell in X19
+// and the mapping in X20.
+void emitTapeSetup(std::ostream &output, uint64_t tape_size,
+                   uint64_t margin) {
+  output << "\tMOV X0, #0\n";
+  emitMoveImmediate(output, "X1", 2 * margin + tape_size);
+  output << "\tMOV W2, #0\n";      // PROT_NONE
+  output << "\tMOV W3, #0x1042\n"; // MAP_PRIVATE | MAP_ANON | MAP_NORESERVE
+  output << "\tMOV W4, #-1\n";
+  output << "\tMOV X5, #0\n";
+  output << "\tBL _mmap\n";
+  output << "\tCMN X0, #1\n"; // MAP_FAILED
+  output << "\tB.EQ Ltape_failed\n";
+  output << "\tMOV X20, X0\n";
+
+  // Open up the tape itself
+  emitMoveImmediate(output, "X9", margin);
+  output << "\tADD X0, X20, X9\n";
+  emitMoveImmediate(output, "X1", tape_size);
+  output << "\tMOV W2, #3\n"; // PROT_READ | PROT_WRITE
+  output << "\tBL _mprotect\n";
+  output << "\tCBNZ W0, Ltape_failed\n";
+  emitMoveImmediate(output, "X9", margin);
+  output << "\tADD X19, X20, X9\n";
+
+  // Report overruns that reach a guard region
+  for (int signal : {11, 10}) { // SIGSEGV, SIGBUS
+    output << "\tMOV W0, #" << signal << "\n";
+    output << "\tADRP X1, Ltape_fault@PAGE\n";
+    output << "\tADD X1, X1, Ltape_fault@PAGEOFF\n";
+    output << "\tBL _signal\n";
+  }
+}
+
+// Unmaps the tape emitTapeSetup mapped at X20
+void emitTapeTeardown(std::ostream &output, uint64_t tape_size,
+                      uint64_t margin) {
+  output << "\tMOV X0, X20\n";
+  emitMoveImmediate(output, "X1", 2 * margin + tape_size);
+  output << "\tBL _munmap\n";
+}
+
+// Out-of-line paths for emitTapeSetup: a failed mapping, and the signal
+// handler for faults in a guard region. Nothing but the tape can fault in
+// generated code, and never inside stdio, so the handler may flush
+// putchar's buffer before it reports the overrun. Emitted ahead of _main,
+// next to the setup code, since B.cond and CBNZ only reach 1 MiB and the
+// program itself can be larger than that.
+void emitTapeRuntime(std::ostream &output) {
+  const std::string failed_message = "Error: Failed to reserve tape memory.";
+  const std::string fault_message =
+      "Error during execution: Data pointer moved outside the tape.";
+
+  output << "Ltape_failed:\n";
+  output << "\tMOV W0, #2\n";
+  output << "\tADRP X1, Ltape_failed_message@PAGE\n";
+  output << "\tADD X1, X1, Ltape_failed_message@PAGEOFF\n";
+  output << "\tMOV X2, #" << failed_message.size() + 1 << "\n";
+  output << "\tBL _write\n";
+  output << "\tMOV W0, #1\n";
+  output << "\tBL __exit\n";
+
+  output << "Ltape_fault:\n";
+  output << "\tMOV X0, #0\n";
+  output << "\tBL _fflush\n";
+  output << "\tMOV W0, #2\n";
+  output << "\tADRP X1, Ltape_fault_message@PAGE\n";
+  output << "\tADD X1, X1, Ltape_fault_message@PAGEOFF\n";
+  output << "\tMOV X2, #" << fault_message.size() + 1 << "\n";
+  output << "\tBL _write\n";
+  output << "\tMOV W0, #1\n";
+  output << "\tBL __exit\n";
+
+  output << "\t.section __TEXT,__cstring\n";
+  output << "Ltape_failed_message:\n";
+  output << "\t.ascii \"" << failed_message << "\\n\"\n";
+  output << "Ltape_fault_message:\n";
+  output << "\t.ascii \"" << fault_message << "\\n\"\n";
+  output << "\t.text\n";
+}
+
+// Linux system call numbers and flags for encoded programs
+const int sys_read = 63, sys_write = 64, sys_munmap = 215, sys_mmap = 222,
+          sys_mprotect = 226, sys_rt_sigaction = 134, sys_exit_group = 94;
+const int sa_siginfo = 0x4;
+
+void encodeSyscall(Encoder &code, int number) {
+  code.emit(moveWide(8, number)); // MOV X8, #number
+  code.emit(0xD4000001);          // SVC #0
+}
+
+// write(2, message) and exit_group(1)
+void encodeFatalError(Encoder &code, int message, uint32_t size) {
+  code.emit(moveWide(0, 2));
+  code.emitBranch(adr(1), message);
+  code.emit(moveWide(2, size));
+  encodeSyscall(code, sys_write);
+  code.emit(moveWide(0, 1));
+  encodeSyscall(code, sys_exit_group);
+}
+
+// Encodes the runtime main calls, then main, with the same tape layout as
+// the assembly and, like it, the runtime first so that the setup code
+// reaches it. The program makes system calls itself rather than calling
+// libc, so the code needs no relocations: output goes through a buffer on
+// main's stack at X16, holding X17 bytes. Returns the offsets of main and
+// of its end.
+std::pair<size_t, size_t>
+encodeProgram(Encoder &code,
+              const std::vector<std::unique_ptr<Instruction>> &instructions,
+              uint64_t tape_size, uint64_t margin) {
+  code.flush_label = code.newLabel();
+  code.input_label = code.newLabel();
+  int failed_label = code.newLabel();
+  int fault_label = code.newLabel();
+  int failed_message = code.newLabel();
+  int fault_message = code.newLabel();
+  const std::string failed_text = "Error: Failed to reserve tape memory.\n";
+  const std::string fault_text =
+      "Error during execution: Data pointer moved outside the tape.\n";
+
+  // flush: writes out the buffer, giving up on write errors
+  int flush_loop = code.newLabel();
+  int flush_done = code.newLabel();
+  code.bind(code.flush_label);
+  code.emit(moveRegister(1, 16));
+  code.emit(moveRegister(2, 17));
+  code.bind(flush_loop);
+  code.emitBranch(compareBranch(2, false, true), flush_done); // CBZ X2
+  code.emit(moveWide(0, 1));
+  encodeSyscall(code, sys_write);
+  code.emit(compareImmediate(0, 0));
+  code.emitBranch(branchIf(cond_le), flush_done);
+  code.emit(addRegister(1, 1, 0));
+  code.emit(addRegister(2, 2, 0, true));
+  code.emitBranch(a64_b, flush_loop);
+  code.bind(flush_done);
+  code.emit(moveWide(17, 0));
+  code.emit(0xD65F03C0); // RET
+
+  // input: flushes, then reads one byte into W0, or 255 at the end of
+  // input, like getchar's EOF stored in a cell
+  int input_done = code.newLabel();
+  code.bind(code.input_label);
+  code.emit(0xF81F0FFE); // STR X30, [SP, #-16]!
+  code.emitBranch(a64_bl, code.flush_label);
+  code.emit(moveWide(0, 0));
+  code.emit(addImmediate(1, 31, 8)); // ADD X1, SP, #8
+  code.emit(moveWide(2, 1));
+  encodeSyscall(code, sys_read);
+  code.emit(compareImmediate(0, 1));
+  code.emit(loadStoreByte(true, 0, 31, 8));
+  code.emitBranch(branchIf(cond_eq), input_done);
+  code.emit(moveWide(0, 255));
+  code.bind(input_done);
+  code.emit(0xF84107FE); // LDR X30, [SP], #16
+  code.emit(0xD65F03C0); // RET
+
+  code.bind(failed_label);
+  encodeFatalError(code, failed_message, failed_text.size());
+
+  // SA_SIGINFO handler: the interrupted X16 and X17 are in the ucontext at
+  // X2, whose saved registers start 184 bytes in
+  code.bind(fault_label);
+  code.emit(0xF9409C50); // LDR X16, [X2, #312]
+  code.emit(0xF940A051); // LDR X17, [X2, #320]
+  code.emitBranch(a64_bl, code.flush_label);
+  encodeFatalError(code, fault_message, fault_text.size());
+
+  code.bind(failed_message);
+  code.code.insert(code.code.end(), failed_text.begin(), failed_text.end());
+  code.bind(fault_message);
+  code.code.insert(code.code.end(), fault_text.begin(), fault_text.end());
+  code.align();
+
+  size_t main_offset = code.code.size();
+  code.emit(pushPair(29, 30));
+  code.emit(addImmediate(29, 31, 0)); // MOV X29, SP
+  code.emit(pushPair(19, 20));
+  for (int reg = 21; reg < 29; reg += 2) {
+    code.emit(pushPair(reg, reg + 1));
+  }
+  code.emit(addImmediate(31, 31, -static_cast<int64_t>(output_buffer_size)));
+  code.emit(addImmediate(16, 31, 0)); // MOV X16, SP
+  code.emit(moveWide(17, 0));
+
+  // mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS |
+  // MAP_NORESERVE, -1, 0)
+  code.emit(moveWide(0, 0));
+  encodeMoveImmediate(code, 1, 2 * margin + tape_size);
+  code.emit(moveWide(2, 0));
+  code.emit(moveWide(3, 0x4022));
+  code.emit(0x92800004); // MOV X4, #-1
+  code.emit(moveWide(5, 0));
+  encodeSyscall(code, sys_mmap);
+  code.emit(compareImmediate(0, -4095)); // Errors are -4095 to -1
+  code.emitBranch(branchIf(cond_hs), failed_label);
+  code.emit(moveRegister(20, 0));
+
+  // Open up the tape itself. System calls preserve every register but X0.
+  encodeMoveImmediate(code, 9, margin);
+  code.emit(addRegister(0, 20, 9));
+  encodeMoveImmediate(code, 1, tape_size);
+  code.emit(moveWide(2, 3)); // PROT_READ | PROT_WRITE
+  encodeSyscall(code, sys_mprotect);
+  code.emitBranch(compareBranch(0, true, true), failed_label); // CBNZ X0
+  code.emit(addRegister(19, 20, 9));
+
+  // Report overruns that reach a guard region. The handler never returns,
+  // so it needs no restorer.
+  code.emit(addImmediate(31, 31, -32));
+  code.emitBranch(adr(9), fault_label);
+  code.emit(0xF90003E9); // STR X9, [SP]
+  code.emit(moveWide(9, sa_siginfo));
+  code.emit(0xF90007E9); // STR X9, [SP, #8]
+  code.emit(0xF9000BFF); // STR XZR, [SP, #16]
+  code.emit(0xF9000FFF); // STR XZR, [SP, #24]
+  for (int signal : {11, 7}) { // SIGSEGV, SIGBUS
+    code.emit(moveWide(0, signal));
+    code.emit(addImmediate(1, 31, 0)); // MOV X1, SP
+    code.emit(moveWide(2, 0));
+    code.emit(moveWide(3, 8)); // Size of the signal mask
+    encodeSyscall(code, sys_rt_sigaction);
+  }
+  code.emit(addImmediate(31, 31, 32));
+
+  for (const auto &instr : instructions) {
+    instr->encode(code);
+  }
+
+  // Flush, unmap the tape and return 0
+  code.emitBranch(a64_bl, code.flush_label);
+  code.emit(moveRegister(0, 20));
+  encodeMoveImmediate(code, 1, 2 * margin + tape_size);
+  encodeSyscall(code, sys_munmap);
+  code.emit(addImmediate(31, 31, output_buffer_size));
+  for (int reg = 27; reg > 20; reg -= 2) {
+    code.emit(popPair(reg, reg + 1));
+  }
+  code.emit(popPair(19, 20));
+  code.emit(popPair(29, 30));
+  code.emit(moveWide(0, 0));
+  code.emit(0xD65F03C0); // RET
+  return {main_offset, code.code.size()};
+}
+
+// Little-endian ELF file contents
+class ElfBuffer {
+public:
+  std::vector<uint8_t> bytes;
+
+  void put(uint64_t value, int size) {
+    for (int i = 0; i < size; ++i) {
+      bytes.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+  }
+  void align(size_t alignment) {
+    while (bytes.size() % alignment != 0) {
+      bytes.push_back(0);
+    }
+  }
+  void putHeader(uint16_t type, uint64_t entry, uint64_t phoff,
+                 uint16_t phnum, uint64_t shoff, uint16_t shnum) {
+    bytes.insert(bytes.end(), {0x7F, 'E', 'L', 'F', 2, 1, 1});
+    bytes.resize(16, 0); // ELFCLASS64, ELFDATA2LSB, EV_CURRENT, System V
+    put(type, 2);
+    put(183, 2); // EM_AARCH64
+    put(1, 4);   // EV_CURRENT
+    put(entry, 8);
+    put(phoff, 8);
+    put(shoff, 8);
+    put(0, 4);  // Flags
+    put(64, 2); // Header size
+    put(phnum ? 56 : 0, 2);
+    put(phnum, 2);
+    put(shnum ? 64 : 0, 2);
+    put(shnum, 2);
+    put(shnum ? shnum - 1 : 0, 2); // .shstrtab comes last
+  }
+  void putSection(uint32_t name, uint32_t type, uint64_t flags,
+                  uint64_t offset, uint64_t size, uint32_t link, uint32_t info,
+                  uint64_t alignment, uint64_t entry_size) {
+    put(name, 4);
+    put(type, 4);
+    put(flags, 8);
+    put(0, 8); // Address
+    put(offset, 8);
+    put(size, 8);
+    put(link, 4);
+    put(info, 4);
+    put(alignment, 8);
+    put(entry_size, 8);
+  }
+};
+
+// Writes an executable that runs the encoded program from a _start of its
+// own: one read-only, executable segment loaded at a fixed address and
+// aligned for 64 KiB pages, no sections, and a non-executable stack
+std::vector<uint8_t> buildExecutable(Encoder &code, size_t main_offset) {
+  const uint64_t base = 0x400000;
+  const uint64_t code_offset = 64 + 2 * 56;
+
+  // _start: exit_group(main()), with a zero frame pointer and link
+  // register ending the chain of frames
+  size_t entry = code.code.size();
+  int main_label = code.newLabel();
+  code.emit(moveWide(29, 0));
+  code.emit(moveWide(30, 0));
+  code.emitBranch(a64_bl, main_label);
+  encodeSyscall(code, sys_exit_group);
+  code.bind(main_label, main_offset);
+  code.resolve();
+
+  ElfBuffer elf;
+  elf.putHeader(2, base + code_offset + entry, 64, 2, 0, 0); // ET_EXEC
+  elf.put(1, 4);                                              // PT_LOAD
+  elf.put(5, 4);                                              // PF_R | PF_X
+  elf.put(0, 8);
+  elf.put(base, 8);
+  elf.put(base, 8);
+  elf.put(code_offset + code.code.size(), 8);
+  elf.put(code_offset + code.code.size(), 8);
+  elf.put(0x10000, 8);
+  elf.put(0x6474E551, 4); // PT_GNU_STACK
+  elf.put(6, 4);          // PF_R | PF_W
+  elf.put(0, 8 * 5);
+  elf.put(16, 8);
+  elf.bytes.insert(elf.bytes.end(), code.code.begin(), code.code.end());
+  return elf.bytes;
+}
+
+// Writes a relocatable object defining main, for the system compiler to
+// link with its C runtime
+std::vector<uint8_t> buildObject(Encoder &code, size_t main_offset,
+                                 size_t main_end) {
+  code.resolve();
+  static const char strtab_data[] = "\0main";
+  static const char shstrtab_data[] =
+      "\0.text\0.symtab\0.strtab\0.note.GNU-stack\0.shstrtab";
+  const std::string strtab(strtab_data, sizeof(strtab_data));
+  const std::string shstrtab(shstrtab_data, sizeof(shstrtab_data));
+
+  ElfBuffer elf;
+  elf.bytes.resize(64); // Header, once the section headers are placed
+  elf.align(16);
+  uint64_t text_offset = elf.bytes.size();
+  elf.bytes.insert(elf.bytes.end(), code.code.begin(), code.code.end());
+
+  elf.align(8);
+  uint64_t symtab_offset = elf.bytes.size();
+  elf.put(0, 24);   // Null symbol
+  elf.put(1, 4);    // "main"
+  elf.put(0x12, 1); // STB_GLOBAL, STT_FUNC
+  elf.put(0, 1);
+  elf.put(1, 2); // .text
+  elf.put(main_offset, 8);
+  elf.put(main_end - main_offset, 8);
+
+  uint64_t strtab_offset = elf.bytes.size();
+  elf.bytes.insert(elf.bytes.end(), strtab.begin(), strtab.end());
+  uint64_t shstrtab_offset = elf.bytes.size();
+  elf.bytes.insert(elf.bytes.end(), shstrtab.begin(), shstrtab.end());
+
+  elf.align(8);
+  uint64_t shoff = elf.bytes.size();
+  elf.put(0, 64); // Null section
+  elf.putSection(1, 1, 6, text_offset, code.code.size(), 0, 0, 16, 0);
+  elf.putSection(7, 2, 0, symtab_offset, 48, 3, 1, 8, 24);
+  elf.putSection(15, 3, 0, strtab_offset, strtab.size(), 0, 0, 1, 0);
+  elf.putSection(23, 1, 0, strtab_offset, 0, 0, 0, 1, 0);
+  elf.putSection(39, 3, 0, shstrtab_offset, shstrtab.size(), 0, 0, 1, 0);
+
+  ElfBuffer header;
+  header.putHeader(1, 0, 0, 0, shoff, 6); // ET_REL
+  std::copy(header.bytes.begin(), header.bytes.end(), elf.bytes.begin());
+  return elf.bytes;
+}
+
+bool parseArguments(int argc, char *argv[], std::string &filename,
+                    uint64_t &tape_size, std::string &emit,
+                    std::string &output_path) {
   if (argc < 2) {
     std::cerr << "Usage: " << argv[0] << " [options] <filename>\n";
     std::cerr << "Options:\n";
@@ -348,14 +1325,25 @@ bool parseArguments(int argc, char *argv[], std::string &filename) {
         << "  --no-optimizations          Disable all loop optimizations\n";
     std::cerr << "  --optimize-simple-loops     Optimize simple loops only\n";
     std::cerr << "  --optimize-memory-scans     Optimize memory scans only\n";
-    std::cerr << "  --optimize-all              Optimize both simple loops and "
-                 "memory scans (default)\n";
+    std::cerr << "  --optimize-blocks           Keep cells of straight-line "
+                 "code in registers only\n";
+    std::cerr << "  --optimize-all              All of the above (default)\n";
+    std::cerr << "  --tape-size=N               Cells on the tape (default "
+                 "1 GiB)\n";
+    std::cerr << "  --emit=asm|obj|exe          Write macOS assembly "
+                 "(default), or a Linux\n";
+    std::cerr << "                              ELF object or executable "
+                 "encoded directly\n";
+    std::cerr << "  -o <path>                   Output path (default "
+                 "output.s, output.o\n";
+    std::cerr << "                              or output)\n";
     return false;
   }
 
-  // Default is to optimize both simple loops and memory scans
+  // Default is to apply every optimization
   optimize_simple_loops = true;
   optimize_memory_scans = true;
+  optimize_blocks = true;
 
   std::vector<std::string> args(argv + 1, argv + argc);
 
@@ -363,15 +1351,38 @@ bool parseArguments(int argc, char *argv[], std::string &filename) {
     if (args[i] == "--no-optimizations") {
       optimize_simple_loops = false;
       optimize_memory_scans = false;
+      optimize_blocks = false;
     } else if (args[i] == "--optimize-simple-loops") {
       optimize_simple_loops = true;
       optimize_memory_scans = false;
+      optimize_blocks = false;
     } else if (args[i] == "--optimize-memory-scans") {
       optimize_simple_loops = false;
       optimize_memory_scans = true;
+      optimize_blocks = false;
+    } else if (args[i] == "--optimize-blocks") {
+      optimize_simple_loops = false;
+      optimize_memory_scans = false;
+      optimize_blocks = true;
     } else if (args[i] == "--optimize-all") {
       optimize_simple_loops = true;
       optimize_memory_scans = true;
+      optimize_blocks = true;
+    } else if (args[i].compare(0, 12, "--tape-size=") == 0) {
+      try {
+        tape_size = std::stoull(args[i].substr(12));
+      } catch (const std::exception &) {
+        std::cerr << "Invalid value for --tape-size\n";
+        return false;
+      }
+    } else if (args[i].compare(0, 7, "--emit=") == 0) {
+      emit = args[i].substr(7);
+      if (emit != "asm" && emit != "obj" && emit != "exe") {
+        std::cerr << "Unknown --emit kind: " << emit << "\n";
+        return false;
+      }
+    } else if (args[i] == "-o" && i + 1 < args.size()) {
+      output_path = args[++i];
     } else if (args[i][0] != '-') {
       filename = args[i];
     } else {
@@ -390,9 +1401,16 @@ bool parseArguments(int argc, char *argv[], std::string &filename) {
 
 int main(int argc, char *argv[]) {
   std::string filename;
-  if (!parseArguments(argc, argv, filename)) {
+  uint64_t tape_size = uint64_t(1) << 30;
+  std::string emit = "asm";
+  std::string output_path;
+  if (!parseArguments(argc, argv, filename, tape_size, emit, output_path)) {
     return 1;
   }
+  if (output_path.empty()) {
+    output_path = emit == "asm" ? "output.s" : emit == "obj" ? "output.o"
+                                                              : "output";
+  }
 
   std::string code;
   std::ifstream file(filename);
@@ -418,10 +1436,52 @@ int main(int argc, char *argv[]) {
   if (optimize_simple_loops || optimize_memory_scans) {
     optimizeInstructions(instructions);
   }
+  if (optimize_blocks) {
+    formBasicBlocks(instructions);
+  }
+
+  // Size the tape. Generated code only touches cells the program itself
+  // touches, and between two of them the pointer moves no further than the
+  // program has '<' and '>', which bounds how far past the tape an overrun
+  // can get before it faults. Pages are at most 16 KiB on ARM64 macOS and
+  // 64 KiB on Linux.
+  const uint64_t page = emit == "asm" ? 16384 : 65536;
+  uint64_t moves = std::count(code.begin(), code.end(), '>') +
+                   std::count(code.begin(), code.end(), '<');
+  tape_size = (tape_size + page - 1) / page * page;
+  uint64_t margin = (moves / page + 1) * page;
+  tape_begin_offset = margin;
+  tape_end_offset = margin + tape_size;
+
+  if (emit != "asm") {
+    std::vector<uint8_t> elf;
+    try {
+      Encoder encoder;
+      std::pair<size_t, size_t> main_range =
+          encodeProgram(encoder, instructions, tape_size, margin);
+      elf = emit == "exe"
+                ? buildExecutable(encoder, main_range.first)
+                : buildObject(encoder, main_range.first, main_range.second);
+    } catch (const std::exception &e) {
+      std::cerr << "Error during code generation: " << e.what() << '\n';
+      return 1;
+    }
+    std::ofstream elf_file(output_path, std::ios::binary);
+    if (!elf_file) {
+      std::cerr << "Failed to open output file.\n";
+      return 1;
+    }
+    elf_file.write(reinterpret_cast<const char *>(elf.data()), elf.size());
+    elf_file.close();
+    if (emit == "exe") {
+      chmod(output_path.c_str(), 0755);
+    }
+    return 0;
+  }
 
   // Generate ARM64 assembly code
   int label_counter = 0;
-  std::ofstream output_file("output.s");
+  std::ofstream output_file(output_path);
   if (!output_file) {
     std::cerr << "Failed to open output file.\n";
     return 1;
@@ -430,31 +1490,23 @@ int main(int argc, char *argv[]) {
   // Define all functions used from external sources
   output_file << "\t.text\n";
   output_file << "\t.global _main\n";
-  output_file << "\t.extern _putchar, _getchar, _malloc, _free, _memset\n";
+  output_file << "\t.extern _putchar, _getchar, _mmap, _mprotect, _munmap, "
+                 "_signal, _write, _fflush, __exit\n";
+  emitTapeRuntime(output_file);
   output_file << "_main:\n";
 
   // Save frame pointer and link register onto stack
   output_file << "\tSTP X29, X30, [SP, #-16]!\n"; //
   output_file << "\tMOV X29, SP\n";
 
-  // Save X19 and X20
+  // Save X19 and X20, and X21-X28, which hold cells in straight-line blocks
   output_file << "\tSTP X19, X20, [SP, #-16]!\n";
+  for (int reg = 21; reg < 29; reg += 2) {
+    output_file << "\tSTP X" << reg << ", X" << reg + 1 << ", [SP, #-16]!\n";
+  }
 
-  // Allocate data array using malloc
-  output_file << "\tMOV X0, #30000\n"; // Allocate 30,000 bytes
-  output_file << "\tBL _malloc\n";
-
-  // Store data pointer for tape in X19
-  output_file << "\tMOV X19, X0\n";
-
-  // Store original pointer allocated in X20
-  output_file << "\tMOV X20, X0\n";
-
-  // Zero out the allocated memory (optional but recommended)
-  output_file << "\tMOV X1, X19\n";    // Destination pointer
-  output_file << "\tMOV W2, #0\n";     // Value to set (zero)
-  output_file << "\tMOV X3, #30000\n"; // Number of bytes
-  output_file << "\tBL _memset\n";
+  // Map the tape
+  emitTapeSetup(output_file, tape_size, margin);
 
   try {
     for (const auto &instr : instructions) {
@@ -465,11 +1517,13 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  // Free the allocated memory
-  output_file << "\tMOV X0, X20\n";
-  output_file << "\tBL _free\n";
+  // Unmap the tape
+  emitTapeTeardown(output_file, tape_size, margin);
 
   // Restore callee-saved registers
+  for (int reg = 27; reg > 20; reg -= 2) {
+    output_file << "\tLDP X" << reg << ", X" << reg + 1 << ", [SP], #16\n";
+  }
   output_file << "\tLDP X19, X20, [SP], #16\n"; // Restore X19 and X20
   output_file << "\tLDP X29, X30, [SP], #16\n"; // Restore frame pointer and
                                                 // link register
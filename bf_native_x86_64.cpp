@@ -0,0 +1,1147 @@
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
+// Generates x86-64 assembly for Linux (System V ABI, ELF) in AT&T syntax,
+// or encodes the same instructions itself and writes an ELF object or
+// executable directly. The data pointer lives in %rbx and the tape mapping
+// in %r12, both callee-saved, so calls to libc leave them alone.
+
+bool optimize_simple_loops = false;
+bool optimize_memory_scans = false;
+
+// Where the tape lies in the mapping at %r12, as byte offsets of its first
+// cell and of the end of its last. Set by main once the tape is sized;
+// memory scans stop at them.
+uint64_t tape_begin_offset = 0;
+uint64_t tape_end_offset = 0;
+
+// Output buffer of encoded programs, which call no libc to buffer for them
+const int32_t output_buffer_size = 1 << 16;
+
+// Machine code under construction. References to labels are rel32
+// displacements, patched once the code is complete.
+class Encoder {
+public:
+  std::vector<uint8_t> code;
+  int flush_label = -1; // Runtime routines that instructions call
+  int input_label = -1;
+
+  int newLabel() {
+    labels.push_back(-1);
+    return static_cast<int>(labels.size() - 1);
+  }
+  void bind(int label) { bind(label, code.size()); }
+  void bind(int label, size_t offset) {
+    labels[label] = static_cast<int64_t>(offset);
+  }
+
+  void emit(std::initializer_list<uint8_t> bytes) {
+    code.insert(code.end(), bytes);
+  }
+  void emit32(int32_t value) {
+    for (int i = 0; i < 4; ++i) {
+      code.push_back(static_cast<uint8_t>(static_cast<uint32_t>(value) >>
+                                          (8 * i)));
+    }
+  }
+  void emit64(uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+      code.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+  }
+  // Opcode bytes followed by the rel32 displacement of label
+  void emitRel32(std::initializer_list<uint8_t> opcode, int label) {
+    emit(opcode);
+    fixups.emplace_back(code.size(), label);
+    emit32(0);
+  }
+
+  void resolve() {
+    for (const auto &fixup : fixups) {
+      int64_t target = labels[fixup.second];
+      if (target < 0) {
+        throw std::runtime_error("Reference to an unbound label");
+      }
+      int32_t displacement =
+          static_cast<int32_t>(target - static_cast<int64_t>(fixup.first + 4));
+      for (int i = 0; i < 4; ++i) {
+        code[fixup.first + i] = static_cast<uint8_t>(
+            static_cast<uint32_t>(displacement) >> (8 * i));
+      }
+    }
+  }
+
+private:
+  std::vector<int64_t> labels;
+  std::vector<std::pair<size_t, int>> fixups;
+};
+
+class Instruction {
+public:
+  virtual ~Instruction() = default;
+  virtual void execute(std::ostream &output, int &label_counter) = 0;
+  virtual void encode(Encoder &code) = 0;
+  virtual bool isLoop() const { return false; }
+  virtual bool isIO() const { return false; }
+  virtual std::unique_ptr<Instruction> optimize() { return nullptr; }
+};
+
+class IncrementDataPointer : public Instruction {
+public:
+  void execute(std::ostream &output, int & /*label_counter*/) override {
+    output << "\tincq %rbx\n";
+  }
+  void encode(Encoder &code) override { code.emit({0x48, 0xFF, 0xC3}); }
+};
+
+class DecrementDataPointer : public Instruction {
+public:
+  void execute(std::ostream &output, int & /*label_counter*/) override {
+    output << "\tdecq %rbx\n";
+  }
+  void encode(Encoder &code) override { code.emit({0x48, 0xFF, 0xCB}); }
+};
+
+class IncrementByte : public Instruction {
+public:
+  void execute(std::ostream &output, int & /*label_counter*/) override {
+    output << "\tincb (%rbx)\n";
+  }
+  void encode(Encoder &code) override { code.emit({0xFE, 0x03}); }
+};
+
+class DecrementByte : public Instruction {
+public:
+  void execute(std::ostream &output, int & /*label_counter*/) override {
+    output << "\tdecb (%rbx)\n";
+  }
+  void encode(Encoder &code) override { code.emit({0xFE, 0x0B}); }
+};
+
+class OutputByte : public Instruction {
+public:
+  void execute(std::ostream &output, int & /*label_counter*/) override {
+    output << "\tmovzbl (%rbx), %edi\n";
+    output << "\tcall putchar@PLT\n";
+  }
+  // Appends the cell to the output buffer at %r13, holding %r14 bytes
+  void encode(Encoder &code) override {
+    int skip = code.newLabel();
+    code.emit({0x0F, 0xB6, 0x03});             // movzbl (%rbx), %eax
+    code.emit({0x43, 0x88, 0x44, 0x35, 0x00}); // movb %al, (%r13,%r14)
+    code.emit({0x49, 0xFF, 0xC6});             // incq %r14
+    code.emit({0x49, 0x81, 0xFE});             // cmpq $size, %r14
+    code.emit32(output_buffer_size);
+    code.emitRel32({0x0F, 0x85}, skip); // jne
+    code.emitRel32({0xE8}, code.flush_label);
+    code.bind(skip);
+  }
+  bool isIO() const override { return true; }
+};
+
+class InputByte : public Instruction {
+public:
+  void execute(std::ostream &output, int & /*label_counter*/) override {
+    output << "\tcall getchar@PLT\n";
+    output << "\tmovb %al, (%rbx)\n";
+  }
+  void encode(Encoder &code) override {
+    code.emitRel32({0xE8}, code.input_label);
+  }
+  bool isIO() const override { return true; }
+};
+
+class OptimizedSimpleLoop : public Instruction {
+public:
+  std::unordered_map<int, int> cell_changes; // cell offset to change
+  OptimizedSimpleLoop(const std::unordered_map<int, int> &changes)
+      : cell_changes(changes) {}
+  void execute(std::ostream &output, int &label_counter) override {
+    // Trip count in %eax: p[0] if the loop decrements it, -p[0] if it
+    // increments it (mod 256 either way). A loop that does not run touches
+    // none of its cells.
+    int skip_label = label_counter++;
+    output << "\tmovzbl (%rbx), %eax\n";
+    output << "\ttestl %eax, %eax\n";
+    output << "\tjz .L" << skip_label << "\n";
+    if (cell_changes[0] == 1) {
+      output << "\tnegl %eax\n";
+    }
+    for (const auto &pair : cell_changes) {
+      int offset = pair.first;
+      int change = pair.second;
+      if (offset == 0)
+        continue; // Skip p[0], we'll set it to 0 at the end
+      if (change == 0)
+        continue; // No change to this cell
+      // Apply the change: p[offset] += trip count * change
+      if (change == 1) {
+        output << "\taddb %al, " << offset << "(%rbx)\n";
+      } else if (change == -1) {
+        output << "\tsubb %al, " << offset << "(%rbx)\n";
+      } else {
+        output << "\timull $" << change << ", %eax, %ecx\n";
+        output << "\taddb %cl, " << offset << "(%rbx)\n";
+      }
+    }
+    // Set p[0] to 0
+    output << "\tmovb $0, (%rbx)\n";
+    output << ".L" << skip_label << ":\n";
+  }
+  void encode(Encoder &code) override {
+    int skip = code.newLabel();
+    code.emit({0x0F, 0xB6, 0x03});      // movzbl (%rbx), %eax
+    code.emit({0x85, 0xC0});            // testl %eax, %eax
+    code.emitRel32({0x0F, 0x84}, skip); // jz
+    if (cell_changes[0] == 1) {
+      code.emit({0xF7, 0xD8}); // negl %eax
+    }
+    for (const auto &pair : cell_changes) {
+      int offset = pair.first;
+      int change = pair.second;
+      if (offset == 0 || change == 0)
+        continue;
+      if (change == 1) {
+        code.emit({0x00, 0x83}); // addb %al, offset(%rbx)
+      } else if (change == -1) {
+        code.emit({0x28, 0x83}); // subb %al, offset(%rbx)
+      } else {
+        code.emit({0x69, 0xC8}); // imull $change, %eax, %ecx
+        code.emit32(change);
+        code.emit({0x00, 0x8B}); // addb %cl, offset(%rbx)
+      }
+      code.emit32(offset);
+    }
+    code.emit({0xC6, 0x03, 0x00}); // movb $0, (%rbx)
+    code.bind(skip);
+  }
+};
+
+// Moves the pointer by stride until it reaches a zero cell. Strides of up
+// to 8 compare 16 cells at a time with PCMPEQB and keep the lanes the scan
+// would visit from the PMOVMSKB mask. Forward scans take the lowest one
+// with TZCNT, backward scans the highest with BSR. Blocks stay within the
+// tape: within 16 cells of its end the scan goes on one cell at a time,
+// like the plain loop longer strides use, since they visit at most two
+// cells per block.
+class OptimizedMemoryScan : public Instruction {
+public:
+  int stride; // Net pointer movement per iteration, a power of two
+  OptimizedMemoryScan(int stride) : stride(stride) {}
+  void execute(std::ostream &output, int &label_counter) override {
+    int loop_label = label_counter++;
+    int found_label = label_counter++;
+    int tail_label = label_counter++;
+    int done_label = label_counter++;
+
+    output << "\t# Optimized Memory Scan\n";
+    if (std::abs(stride) <= 8) {
+      // %rcx is the last block the tape holds: its start going forward,
+      // its end going backward
+      output << "\tmovabsq $" << blockLimit() << ", %rcx\n";
+      output << "\taddq %r12, %rcx\n";
+      output << "\tpxor %xmm1, %xmm1\n";
+      output << ".L" << loop_label << ":\n";
+      output << "\tcmpq %rcx, %rbx\n";
+      output << "\t" << (stride > 0 ? "ja" : "jb") << " .L" << tail_label
+             << "\n";
+      output << "\tmovdqu " << (stride > 0 ? "" : "-15")
+             << "(%rbx), %xmm0\n";
+      output << "\tpcmpeqb %xmm1, %xmm0\n";
+      output << "\tpmovmskb %xmm0, %eax\n";
+      if (lanes() != 0xFFFF) {
+        output << "\tandl $" << lanes() << ", %eax\n";
+      } else {
+        output << "\ttestl %eax, %eax\n";
+      }
+      output << "\tjnz .L" << found_label << "\n";
+      output << "\taddq $" << (stride > 0 ? 16 : -16) << ", %rbx\n";
+      output << "\tjmp .L" << loop_label << "\n";
+    }
+
+    output << ".L" << tail_label << ":\n";
+    output << "\tcmpb $0, (%rbx)\n";
+    output << "\tje .L" << done_label << "\n";
+    output << "\taddq $" << stride << ", %rbx\n";
+    output << "\tjmp .L" << tail_label << "\n";
+
+    output << ".L" << found_label << ":\n";
+    if (std::abs(stride) <= 8) {
+      if (stride > 0) {
+        output << "\ttzcntl %eax, %eax\n";
+        output << "\taddq %rax, %rbx\n";
+      } else {
+        output << "\tbsrl %eax, %eax\n";
+        output << "\tleaq -15(%rbx,%rax), %rbx\n";
+      }
+    }
+    output << ".L" << done_label << ":\n";
+  }
+
+  void encode(Encoder &code) override {
+    int loop_label = code.newLabel();
+    int found_label = code.newLabel();
+    int tail_label = code.newLabel();
+    int done_label = code.newLabel();
+
+    if (std::abs(stride) <= 8) {
+      code.emit({0x48, 0xB9}); // movabsq $limit, %rcx
+      code.emit64(blockLimit());
+      code.emit({0x4C, 0x01, 0xE1});       // addq %r12, %rcx
+      code.emit({0x66, 0x0F, 0xEF, 0xC9}); // pxor %xmm1, %xmm1
+      code.bind(loop_label);
+      code.emit({0x48, 0x39, 0xCB}); // cmpq %rcx, %rbx
+      code.emitRel32({0x0F, static_cast<uint8_t>(stride > 0 ? 0x87 : 0x82)},
+                     tail_label);          // ja or jb
+      code.emit({0xF3, 0x0F, 0x6F, 0x83}); // movdqu disp(%rbx), %xmm0
+      code.emit32(stride > 0 ? 0 : -15);
+      code.emit({0x66, 0x0F, 0x74, 0xC1}); // pcmpeqb %xmm1, %xmm0
+      code.emit({0x66, 0x0F, 0xD7, 0xC0}); // pmovmskb %xmm0, %eax
+      if (lanes() != 0xFFFF) {
+        code.emit({0x25}); // andl $lanes, %eax
+        code.emit32(static_cast<int32_t>(lanes()));
+      } else {
+        code.emit({0x85, 0xC0}); // testl %eax, %eax
+      }
+      code.emitRel32({0x0F, 0x85}, found_label); // jnz
+      code.emit(
+          {0x48, 0x83, 0xC3, static_cast<uint8_t>(stride > 0 ? 16 : -16)});
+      code.emitRel32({0xE9}, loop_label); // jmp
+    }
+
+    code.bind(tail_label);
+    code.emit({0x80, 0x3B, 0x00});            // cmpb $0, (%rbx)
+    code.emitRel32({0x0F, 0x84}, done_label); // je
+    code.emit({0x48, 0x81, 0xC3});            // addq $stride, %rbx
+    code.emit32(stride);
+    code.emitRel32({0xE9}, tail_label); // jmp
+
+    code.bind(found_label);
+    if (std::abs(stride) <= 8) {
+      if (stride > 0) {
+        code.emit({0xF3, 0x0F, 0xBC, 0xC0}); // tzcntl %eax, %eax
+        code.emit({0x48, 0x01, 0xC3});       // addq %rax, %rbx
+      } else {
+        code.emit({0x0F, 0xBD, 0xC0});             // bsrl %eax, %eax
+        code.emit({0x48, 0x8D, 0x5C, 0x03, 0xF1}); // leaq -15(%rbx,%rax), %rbx
+      }
+    }
+    code.bind(done_label);
+  }
+
+private:
+  // Bit i of the mask stands for the cell at block + i. Forward blocks
+  // start at the pointer; backward blocks end there, at lane 15.
+  uint32_t lanes() const {
+    uint32_t mask = 0;
+    for (int lane = 0; lane < 16; lane += std::abs(stride)) {
+      mask |= 1u << (stride > 0 ? lane : 15 - lane);
+    }
+    return mask;
+  }
+
+  // Offset in the mapping of the last block that fits in the tape
+  uint64_t blockLimit() const {
+    return stride > 0 ? tape_end_offset - 16 : tape_begin_offset + 15;
+  }
+};
+
+void optimizeInstructions(
+    std::vector<std::unique_ptr<Instruction>> &instructions);
+
+class Loop : public Instruction {
+public:
+  std::vector<std::unique_ptr<Instruction>> instructions;
+  bool isLoop() const override { return true; }
+
+  void execute(std::ostream &output, int &label_counter) override {
+    int start_label = label_counter++;
+    int end_label = label_counter++;
+
+    output << ".L" << start_label << ":\n";
+    output << "\tcmpb $0, (%rbx)\n";
+    output << "\tje .L" << end_label << "\n";
+
+    for (const auto &instr : instructions) {
+      instr->execute(output, label_counter);
+    }
+
+    output << "\tjmp .L" << start_label << "\n";
+    output << ".L" << end_label << ":\n";
+  }
+
+  void encode(Encoder &code) override {
+    int start_label = code.newLabel();
+    int end_label = code.newLabel();
+    code.bind(start_label);
+    code.emit({0x80, 0x3B, 0x00});           // cmpb $0, (%rbx)
+    code.emitRel32({0x0F, 0x84}, end_label); // je
+    for (const auto &instr : instructions) {
+      instr->encode(code);
+    }
+    code.emitRel32({0xE9}, start_label); // jmp
+    code.bind(end_label);
+  }
+
+  std::unique_ptr<Instruction> optimize() override {
+    // First, optimize inner loops recursively
+    optimizeInstructions(instructions);
+
+    // Apply optimizations based on flags
+    if (optimize_simple_loops && canOptimizeSimpleLoop()) {
+      // Create an OptimizedSimpleLoop
+      std::unordered_map<int, int> cell_changes = getCellChanges();
+      return std::make_unique<OptimizedSimpleLoop>(cell_changes);
+    } else if (optimize_memory_scans && canOptimizeMemoryScan()) {
+      return std::make_unique<OptimizedMemoryScan>(getMemoryScanStride());
+    }
+    // No optimization possible; return nullptr
+    return nullptr;
+  }
+
+private:
+  bool canOptimizeSimpleLoop() const {
+    int pointer = 0;
+    std::unordered_map<int, int> cell_changes;
+    for (const auto &instr : instructions) {
+      if (instr->isLoop() || instr->isIO()) {
+        return false; // Contains loops or I/O
+      }
+      if (dynamic_cast<const IncrementDataPointer *>(instr.get())) {
+        pointer += 1;
+      } else if (dynamic_cast<const DecrementDataPointer *>(instr.get())) {
+        pointer -= 1;
+      } else if (dynamic_cast<const IncrementByte *>(instr.get())) {
+        cell_changes[pointer] += 1;
+      } else if (dynamic_cast<const DecrementByte *>(instr.get())) {
+        cell_changes[pointer] -= 1;
+      } else {
+        return false; // Unknown instruction
+      }
+    }
+    if (pointer != 0) {
+      return false; // Net pointer movement is not zero
+    }
+    if (cell_changes[0] != -1 && cell_changes[0] != 1) {
+      return false; // p[0] not changed by +1 or -1
+    }
+    return true;
+  }
+
+  std::unordered_map<int, int> getCellChanges() const {
+    int pointer = 0;
+    std::unordered_map<int, int> cell_changes;
+    for (const auto &instr : instructions) {
+      if (dynamic_cast<const IncrementDataPointer *>(instr.get())) {
+        pointer += 1;
+      } else if (dynamic_cast<const DecrementDataPointer *>(instr.get())) {
+        pointer -= 1;
+      } else if (dynamic_cast<const IncrementByte *>(instr.get())) {
+        cell_changes[pointer] += 1;
+      } else if (dynamic_cast<const DecrementByte *>(instr.get())) {
+        cell_changes[pointer] -= 1;
+      }
+    }
+    return cell_changes;
+  }
+
+  bool canOptimizeMemoryScan() const {
+    int pointer = 0;
+    for (const auto &instr : instructions) {
+      if (instr->isLoop() || instr->isIO()) {
+        return false; // Contains loops or I/O
+      }
+      if (dynamic_cast<const IncrementDataPointer *>(instr.get())) {
+        pointer += 1;
+      } else if (dynamic_cast<const DecrementDataPointer *>(instr.get())) {
+        pointer -= 1;
+      } else {
+        return false; // Contains instructions other than '<' or '>'
+      }
+    }
+    if (pointer == 0) {
+      return false; // Net pointer movement is zero
+    }
+    // Check if net pointer movement is a power of 2
+    int abs_pointer = std::abs(pointer);
+    return (abs_pointer & (abs_pointer - 1)) == 0;
+  }
+
+  int getMemoryScanStride() const {
+    int pointer = 0;
+    for (const auto &instr : instructions) {
+      if (dynamic_cast<const IncrementDataPointer *>(instr.get())) {
+        pointer += 1;
+      } else if (dynamic_cast<const DecrementDataPointer *>(instr.get())) {
+        pointer -= 1;
+      }
+    }
+    return pointer;
+  }
+};
+
+void optimizeInstructions(
+    std::vector<std::unique_ptr<Instruction>> &instructions) {
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    auto &instr = instructions[i];
+    if (auto optimized_instr = instr->optimize()) {
+      // Replace the instruction with the optimized instruction
+      instructions[i] = std::move(optimized_instr);
+    } else {
+      // If the instruction is a Loop, we need to optimize its inner
+      // instructions
+      if (auto loop = dynamic_cast<Loop *>(instr.get())) {
+        optimizeInstructions(loop->instructions);
+      }
+    }
+  }
+}
+
+// Parsing function
+std::vector<std::unique_ptr<Instruction>> parse(const std::string &code,
+                                                size_t &index) {
+  std::vector<std::unique_ptr<Instruction>> instructions;
+
+  while (index < code.size()) {
+    char cmd = code[index++];
+    switch (cmd) {
+    case '>':
+      instructions.push_back(std::make_unique<IncrementDataPointer>());
+      break;
+    case '<':
+      instructions.push_back(std::make_unique<DecrementDataPointer>());
+      break;
+    case '+':
+      instructions.push_back(std::make_unique<IncrementByte>());
+      break;
+    case '-':
+      instructions.push_back(std::make_unique<DecrementByte>());
+      break;
+    case '.':
+      instructions.push_back(std::make_unique<OutputByte>());
+      break;
+    case ',':
+      instructions.push_back(std::make_unique<InputByte>());
+      break;
+    case '[': {
+      auto loop = std::make_unique<Loop>();
+      loop->instructions = parse(code, index);
+      instructions.push_back(std::move(loop));
+      break;
+    }
+    case ']':
+      return instructions;
+    default:
+      // Ignore non-command characters (comments)
+      break;
+    }
+  }
+  return instructions;
+}
+
+// Maps the tape between two PROT_NONE guard regions of margin bytes; the
+// kernel zeroes pages lazily, on first touch. Leaves the first cell in %rbx
+// and the mapping in %r12.
+void emitTapeSetup(std::ostream &output, uint64_t tape_size,
+                   uint64_t margin) {
+  output << "\txorl %edi, %edi\n";
+  output << "\tmovabsq $" << 2 * margin + tape_size << ", %rsi\n";
+  output << "\txorl %edx, %edx\n";    // PROT_NONE
+  output << "\tmovl $0x4022, %ecx\n"; // MAP_PRIVATE | MAP_ANON | NORESERVE
+  output << "\tmovl $-1, %r8d\n";
+  output << "\txorl %r9d, %r9d\n";
+  output << "\tcall mmap@PLT\n";
+  output << "\tcmpq $-1, %rax\n"; // MAP_FAILED
+  output << "\tje .Ltape_failed\n";
+  output << "\tmovq %rax, %r12\n";
+
+  // Open up the tape itself
+  output << "\tmovabsq $" << margin << ", %rdi\n";
+  output << "\taddq %r12, %rdi\n";
+  output << "\tmovabsq $" << tape_size << ", %rsi\n";
+  output << "\tmovl $3, %edx\n"; // PROT_READ | PROT_WRITE
+  output << "\tcall mprotect@PLT\n";
+  output << "\ttestl %eax, %eax\n";
+  output << "\tjnz .Ltape_failed\n";
+  output << "\tmovabsq $" << margin << ", %rbx\n";
+  output << "\taddq %r12, %rbx\n";
+
+  // Report overruns that reach a guard region
+  for (int signal : {11, 7}) { // SIGSEGV, SIGBUS
+    output << "\tmovl $" << signal << ", %edi\n";
+    output << "\tleaq .Ltape_fault(%rip), %rsi\n";
+    output << "\tcall signal@PLT\n";
+  }
+}
+
+// Unmaps the tape emitTapeSetup mapped at %r12
+void emitTapeTeardown(std::ostream &output, uint64_t tape_size,
+                      uint64_t margin) {
+  output << "\tmovq %r12, %rdi\n";
+  output << "\tmovabsq $" << 2 * margin + tape_size << ", %rsi\n";
+  output << "\tcall munmap@PLT\n";
+}
+
+// Out-of-line paths for emitTapeSetup: a failed mapping, and the signal
+// handler for faults in a guard region. Nothing but the tape can fault in
+// generated code, and never inside stdio, so the handler may flush
+// putchar's buffer before it reports the overrun.
+void emitTapeRuntime(std::ostream &output) {
+  const std::string failed_message = "Error: Failed to reserve tape memory.";
+  const std::string fault_message =
+      "Error during execution: Data pointer moved outside the tape.";
+
+  // main's stack is still aligned here
+  output << ".Ltape_failed:\n";
+  output << "\tmovl $2, %edi\n";
+  output << "\tleaq .Ltape_failed_message(%rip), %rsi\n";
+  output << "\tmovl $" << failed_message.size() + 1 << ", %edx\n";
+  output << "\tcall write@PLT\n";
+  output << "\tmovl $1, %edi\n";
+  output << "\tcall _exit@PLT\n";
+
+  // Entered like a call, so the return address leaves the stack 8 bytes
+  // off the 16-byte alignment calls need
+  output << ".Ltape_fault:\n";
+  output << "\tsubq $8, %rsp\n";
+  output << "\txorl %edi, %edi\n";
+  output << "\tcall fflush@PLT\n";
+  output << "\tmovl $2, %edi\n";
+  output << "\tleaq .Ltape_fault_message(%rip), %rsi\n";
+  output << "\tmovl $" << fault_message.size() + 1 << ", %edx\n";
+  output << "\tcall write@PLT\n";
+  output << "\tmovl $1, %edi\n";
+  output << "\tcall _exit@PLT\n";
+
+  output << "\t.section .rodata\n";
+  output << ".Ltape_failed_message:\n";
+  output << "\t.ascii \"" << failed_message << "\\n\"\n";
+  output << ".Ltape_fault_message:\n";
+  output << "\t.ascii \"" << fault_message << "\\n\"\n";
+
+  // The stack need not be executable
+  output << "\t.section .note.GNU-stack,\"\",@progbits\n";
+}
+
+// Linux system call numbers and flags for encoded programs
+const int32_t sys_read = 0, sys_write = 1, sys_mmap = 9, sys_mprotect = 10,
+              sys_munmap = 11, sys_rt_sigaction = 13, sys_exit_group = 231;
+const int32_t sa_siginfo = 0x4, sa_restorer = 0x4000000;
+
+void encodeSyscall(Encoder &code, int32_t number) {
+  code.emit({0xB8}); // movl $number, %eax
+  code.emit32(number);
+  code.emit({0x0F, 0x05}); // syscall
+}
+
+// write(2, message) and exit_group(1)
+void encodeFatalError(Encoder &code, int message, int32_t size) {
+  code.emit({0xBF, 0x02, 0x00, 0x00, 0x00}); // movl $2, %edi
+  code.emitRel32({0x48, 0x8D, 0x35}, message); // leaq message(%rip), %rsi
+  code.emit({0xBA});                           // movl $size, %edx
+  code.emit32(size);
+  encodeSyscall(code, sys_write);
+  code.emit({0xBF, 0x01, 0x00, 0x00, 0x00}); // movl $1, %edi
+  encodeSyscall(code, sys_exit_group);
+}
+
+// Encodes main, with the same tape layout as the assembly, followed by the
+// runtime it calls. The program makes system calls itself rather than
+// calling libc, so the code needs no relocations: output goes through a
+// buffer on main's stack at %r13, holding %r14 bytes. Returns the offsets
+// of main and of its end.
+std::pair<size_t, size_t>
+encodeProgram(Encoder &code,
+              const std::vector<std::unique_ptr<Instruction>> &instructions,
+              uint64_t tape_size, uint64_t margin) {
+  code.flush_label = code.newLabel();
+  code.input_label = code.newLabel();
+  int failed_label = code.newLabel();
+  int fault_label = code.newLabel();
+  int failed_message = code.newLabel();
+  int fault_message = code.newLabel();
+  const std::string failed_text = "Error: Failed to reserve tape memory.\n";
+  const std::string fault_text =
+      "Error during execution: Data pointer moved outside the tape.\n";
+
+  size_t main_offset = code.code.size();
+  code.emit({0x55});             // pushq %rbp
+  code.emit({0x48, 0x89, 0xE5}); // movq %rsp, %rbp
+  code.emit({0x53});             // pushq %rbx
+  code.emit({0x41, 0x54});       // pushq %r12
+  code.emit({0x41, 0x55});       // pushq %r13
+  code.emit({0x41, 0x56});       // pushq %r14
+  code.emit({0x48, 0x81, 0xEC}); // subq $size, %rsp
+  code.emit32(output_buffer_size);
+  code.emit({0x49, 0x89, 0xE5}); // movq %rsp, %r13
+  code.emit({0x45, 0x31, 0xF6}); // xorl %r14d, %r14d
+
+  // mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS |
+  // MAP_NORESERVE, -1, 0)
+  code.emit({0x31, 0xFF}); // xorl %edi, %edi
+  code.emit({0x48, 0xBE}); // movabsq $total, %rsi
+  code.emit64(2 * margin + tape_size);
+  code.emit({0x31, 0xD2});       // xorl %edx, %edx
+  code.emit({0x41, 0xBA});       // movl $flags, %r10d
+  code.emit32(0x4022);
+  code.emit({0x49, 0xC7, 0xC0}); // movq $-1, %r8
+  code.emit32(-1);
+  code.emit({0x45, 0x31, 0xC9}); // xorl %r9d, %r9d
+  encodeSyscall(code, sys_mmap);
+  code.emit({0x48, 0x3D});       // cmpq $-4095, %rax
+  code.emit32(-4095);
+  code.emitRel32({0x0F, 0x83}, failed_label); // jae
+  code.emit({0x49, 0x89, 0xC4});              // movq %rax, %r12
+
+  // Open up the tape itself
+  code.emit({0x48, 0xBF}); // movabsq $margin, %rdi
+  code.emit64(margin);
+  code.emit({0x4C, 0x01, 0xE7}); // addq %r12, %rdi
+  code.emit({0x48, 0xBE});       // movabsq $size, %rsi
+  code.emit64(tape_size);
+  code.emit({0xBA, 0x03, 0x00, 0x00, 0x00}); // movl $3, %edx
+  encodeSyscall(code, sys_mprotect);
+  code.emit({0x85, 0xC0});                    // testl %eax, %eax
+  code.emitRel32({0x0F, 0x85}, failed_label); // jnz
+  code.emit({0x48, 0xBB});                    // movabsq $offset, %rbx
+  code.emit64(margin);
+  code.emit({0x4C, 0x01, 0xE3}); // addq %r12, %rbx
+
+  // Report overruns that reach a guard region. The kernel requires a
+  // restorer, but the handler never returns, so it is its own.
+  code.emit({0x48, 0x83, 0xEC, 0x20});              // subq $32, %rsp
+  code.emitRel32({0x48, 0x8D, 0x05}, fault_label);  // leaq fault(%rip), %rax
+  code.emit({0x48, 0x89, 0x04, 0x24});              // movq %rax, (%rsp)
+  code.emit({0x48, 0xC7, 0x44, 0x24, 0x08});        // movq $flags, 8(%rsp)
+  code.emit32(sa_siginfo | sa_restorer);
+  code.emit({0x48, 0x89, 0x44, 0x24, 0x10});        // movq %rax, 16(%rsp)
+  code.emit({0x48, 0xC7, 0x44, 0x24, 0x18});        // movq $0, 24(%rsp)
+  code.emit32(0);
+  for (int32_t signal : {11, 7}) { // SIGSEGV, SIGBUS
+    code.emit({0xBF});             // movl $signal, %edi
+    code.emit32(signal);
+    code.emit({0x48, 0x89, 0xE6});             // movq %rsp, %rsi
+    code.emit({0x31, 0xD2});                   // xorl %edx, %edx
+    code.emit({0x41, 0xBA, 0x08, 0x00, 0x00, 0x00}); // movl $8, %r10d
+    encodeSyscall(code, sys_rt_sigaction);
+  }
+  code.emit({0x48, 0x83, 0xC4, 0x20}); // addq $32, %rsp
+
+  for (const auto &instr : instructions) {
+    instr->encode(code);
+  }
+
+  // Flush, unmap the tape and return 0
+  code.emitRel32({0xE8}, code.flush_label);
+  code.emit({0x4C, 0x89, 0xE7}); // movq %r12, %rdi
+  code.emit({0x48, 0xBE});       // movabsq $total, %rsi
+  code.emit64(2 * margin + tape_size);
+  encodeSyscall(code, sys_munmap);
+  code.emit({0x48, 0x81, 0xC4}); // addq $size, %rsp
+  code.emit32(output_buffer_size);
+  code.emit({0x41, 0x5E}); // popq %r14
+  code.emit({0x41, 0x5D}); // popq %r13
+  code.emit({0x41, 0x5C}); // popq %r12
+  code.emit({0x5B});       // popq %rbx
+  code.emit({0x5D});       // popq %rbp
+  code.emit({0x31, 0xC0}); // xorl %eax, %eax
+  code.emit({0xC3});       // ret
+  size_t main_end = code.code.size();
+
+  // flush: writes out the buffer, giving up on write errors
+  int flush_loop = code.newLabel();
+  int flush_done = code.newLabel();
+  code.bind(code.flush_label);
+  code.emit({0x4C, 0x89, 0xEE}); // movq %r13, %rsi
+  code.emit({0x4C, 0x89, 0xF2}); // movq %r14, %rdx
+  code.bind(flush_loop);
+  code.emit({0x48, 0x85, 0xD2});            // testq %rdx, %rdx
+  code.emitRel32({0x0F, 0x84}, flush_done); // jz
+  code.emit({0xBF, 0x01, 0x00, 0x00, 0x00}); // movl $1, %edi
+  encodeSyscall(code, sys_write);
+  code.emit({0x48, 0x85, 0xC0});            // testq %rax, %rax
+  code.emitRel32({0x0F, 0x8E}, flush_done); // jle
+  code.emit({0x48, 0x01, 0xC6});            // addq %rax, %rsi
+  code.emit({0x48, 0x29, 0xC2});            // subq %rax, %rdx
+  code.emitRel32({0xE9}, flush_loop);       // jmp
+  code.bind(flush_done);
+  code.emit({0x45, 0x31, 0xF6}); // xorl %r14d, %r14d
+  code.emit({0xC3});             // ret
+
+  // input: flushes, then reads one byte into the cell, or 255 at the end
+  // of input, like getchar's EOF stored in a cell
+  int input_done = code.newLabel();
+  code.bind(code.input_label);
+  code.emitRel32({0xE8}, code.flush_label);
+  code.emit({0x31, 0xFF});                   // xorl %edi, %edi
+  code.emit({0x48, 0x89, 0xDE});             // movq %rbx, %rsi
+  code.emit({0xBA, 0x01, 0x00, 0x00, 0x00}); // movl $1, %edx
+  encodeSyscall(code, sys_read);
+  code.emit({0x48, 0x83, 0xF8, 0x01});      // cmpq $1, %rax
+  code.emitRel32({0x0F, 0x84}, input_done); // je
+  code.emit({0xC6, 0x03, 0xFF});            // movb $255, (%rbx)
+  code.bind(input_done);
+  code.emit({0xC3}); // ret
+
+  code.bind(failed_label);
+  encodeFatalError(code, failed_message,
+                   static_cast<int32_t>(failed_text.size()));
+
+  // SA_SIGINFO handler: the interrupted %r13 and %r14 are in the
+  // ucontext's saved registers, at REG_R13 and REG_R14
+  code.bind(fault_label);
+  code.emit({0x4C, 0x8B, 0x6A, 0x50}); // movq 80(%rdx), %r13
+  code.emit({0x4C, 0x8B, 0x72, 0x58}); // movq 88(%rdx), %r14
+  code.emitRel32({0xE8}, code.flush_label);
+  encodeFatalError(code, fault_message,
+                   static_cast<int32_t>(fault_text.size()));
+
+  code.bind(failed_message);
+  code.code.insert(code.code.end(), failed_text.begin(), failed_text.end());
+  code.bind(fault_message);
+  code.code.insert(code.code.end(), fault_text.begin(), fault_text.end());
+  return {main_offset, main_end};
+}
+
+// Little-endian ELF file contents
+class ElfBuffer {
+public:
+  std::vector<uint8_t> bytes;
+
+  void put(uint64_t value, int size) {
+    for (int i = 0; i < size; ++i) {
+      bytes.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+  }
+  void align(size_t alignment) {
+    while (bytes.size() % alignment != 0) {
+      bytes.push_back(0);
+    }
+  }
+  void putHeader(uint16_t type, uint64_t entry, uint64_t phoff,
+                 uint16_t phnum, uint64_t shoff, uint16_t shnum) {
+    bytes.insert(bytes.end(), {0x7F, 'E', 'L', 'F', 2, 1, 1});
+    bytes.resize(16, 0); // ELFCLASS64, ELFDATA2LSB, EV_CURRENT, System V
+    put(type, 2);
+    put(62, 2); // EM_X86_64
+    put(1, 4);  // EV_CURRENT
+    put(entry, 8);
+    put(phoff, 8);
+    put(shoff, 8);
+    put(0, 4);  // Flags
+    put(64, 2); // Header size
+    put(phnum ? 56 : 0, 2);
+    put(phnum, 2);
+    put(shnum ? 64 : 0, 2);
+    put(shnum, 2);
+    put(shnum ? shnum - 1 : 0, 2); // .shstrtab comes last
+  }
+  void putSection(uint32_t name, uint32_t type, uint64_t flags,
+                  uint64_t offset, uint64_t size, uint32_t link, uint32_t info,
+                  uint64_t alignment, uint64_t entry_size) {
+    put(name, 4);
+    put(type, 4);
+    put(flags, 8);
+    put(0, 8); // Address
+    put(offset, 8);
+    put(size, 8);
+    put(link, 4);
+    put(info, 4);
+    put(alignment, 8);
+    put(entry_size, 8);
+  }
+};
+
+// Writes an executable that runs the encoded program from a _start of its
+// own: one read-only, executable segment loaded at a fixed address, no
+// sections, and a non-executable stack
+std::vector<uint8_t> buildExecutable(Encoder &code, size_t main_offset) {
+  const uint64_t base = 0x400000;
+  const uint64_t code_offset = 64 + 2 * 56;
+
+  // _start: exit_group(main()). The kernel leaves the stack 16-byte
+  // aligned, and the call makes it look like any other call to main.
+  size_t entry = code.code.size();
+  int main_label = code.newLabel();
+  code.emit({0x31, 0xED}); // xorl %ebp, %ebp
+  code.emitRel32({0xE8}, main_label);
+  code.emit({0x89, 0xC7}); // movl %eax, %edi
+  encodeSyscall(code, sys_exit_group);
+  code.bind(main_label, main_offset);
+  code.resolve();
+
+  ElfBuffer elf;
+  elf.putHeader(2, base + code_offset + entry, 64, 2, 0, 0); // ET_EXEC
+  elf.put(1, 4);                                              // PT_LOAD
+  elf.put(5, 4);                                              // PF_R | PF_X
+  elf.put(0, 8);
+  elf.put(base, 8);
+  elf.put(base, 8);
+  elf.put(code_offset + code.code.size(), 8);
+  elf.put(code_offset + code.code.size(), 8);
+  elf.put(0x1000, 8);
+  elf.put(0x6474E551, 4); // PT_GNU_STACK
+  elf.put(6, 4);          // PF_R | PF_W
+  elf.put(0, 8 * 5);
+  elf.put(16, 8);
+  elf.bytes.insert(elf.bytes.end(), code.code.begin(), code.code.end());
+  return elf.bytes;
+}
+
+// Writes a relocatable object defining main, for the system compiler to
+// link with its C runtime
+std::vector<uint8_t> buildObject(Encoder &code, size_t main_offset,
+                                 size_t main_end) {
+  code.resolve();
+  static const char strtab_data[] = "\0main";
+  static const char shstrtab_data[] =
+      "\0.text\0.symtab\0.strtab\0.note.GNU-stack\0.shstrtab";
+  const std::string strtab(strtab_data, sizeof(strtab_data));
+  const std::string shstrtab(shstrtab_data, sizeof(shstrtab_data));
+
+  ElfBuffer elf;
+  elf.bytes.resize(64); // Header, once the section headers are placed
+  elf.align(16);
+  uint64_t text_offset = elf.bytes.size();
+  elf.bytes.insert(elf.bytes.end(), code.code.begin(), code.code.end());
+
+  elf.align(8);
+  uint64_t symtab_offset = elf.bytes.size();
+  elf.put(0, 24); // Null symbol
+  elf.put(1, 4);  // "main"
+  elf.put(0x12, 1); // STB_GLOBAL, STT_FUNC
+  elf.put(0, 1);
+  elf.put(1, 2); // .text
+  elf.put(main_offset, 8);
+  elf.put(main_end - main_offset, 8);
+
+  uint64_t strtab_offset = elf.bytes.size();
+  elf.bytes.insert(elf.bytes.end(), strtab.begin(), strtab.end());
+  uint64_t shstrtab_offset = elf.bytes.size();
+  elf.bytes.insert(elf.bytes.end(), shstrtab.begin(), shstrtab.end());
+
+  elf.align(8);
+  uint64_t shoff = elf.bytes.size();
+  elf.put(0, 64); // Null section
+  elf.putSection(1, 1, 6, text_offset, code.code.size(), 0, 0, 16, 0);
+  elf.putSection(7, 2, 0, symtab_offset, 48, 3, 1, 8, 24);
+  elf.putSection(15, 3, 0, strtab_offset, strtab.size(), 0, 0, 1, 0);
+  elf.putSection(23, 1, 0, strtab_offset, 0, 0, 0, 1, 0);
+  elf.putSection(39, 3, 0, shstrtab_offset, shstrtab.size(), 0, 0, 1, 0);
+
+  ElfBuffer header;
+  header.putHeader(1, 0, 0, 0, shoff, 6); // ET_REL
+  std::copy(header.bytes.begin(), header.bytes.end(), elf.bytes.begin());
+  return elf.bytes;
+}
+
+bool parseArguments(int argc, char *argv[], std::string &filename,
+                    uint64_t &tape_size, std::string &emit,
+                    std::string &output_path) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " [options] <filename>\n";
+    std::cerr << "Options:\n";
+    std::cerr
+        << "  --no-optimizations          Disable all loop optimizations\n";
+    std::cerr << "  --optimize-simple-loops     Optimize simple loops only\n";
+    std::cerr << "  --optimize-memory-scans     Optimize memory scans only\n";
+    std::cerr << "  --optimize-all              Optimize both simple loops and "
+                 "memory scans (default)\n";
+    std::cerr << "  --tape-size=N               Cells on the tape (default "
+                 "1 GiB)\n";
+    std::cerr << "  --emit=asm|obj|exe          Write assembly (default), "
+                 "or an ELF object\n";
+    std::cerr << "                              or executable encoded "
+                 "directly\n";
+    std::cerr << "  -o <path>                   Output path (default "
+                 "output.s, output.o\n";
+    std::cerr << "                              or output)\n";
+    return false;
+  }
+
+  // Default is to optimize both simple loops and memory scans
+  optimize_simple_loops = true;
+  optimize_memory_scans = true;
+
+  std::vector<std::string> args(argv + 1, argv + argc);
+
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (args[i] == "--no-optimizations") {
+      optimize_simple_loops = false;
+      optimize_memory_scans = false;
+    } else if (args[i] == "--optimize-simple-loops") {
+      optimize_simple_loops = true;
+      optimize_memory_scans = false;
+    } else if (args[i] == "--optimize-memory-scans") {
+      optimize_simple_loops = false;
+      optimize_memory_scans = true;
+    } else if (args[i] == "--optimize-all") {
+      optimize_simple_loops = true;
+      optimize_memory_scans = true;
+    } else if (args[i].compare(0, 12, "--tape-size=") == 0) {
+      try {
+        tape_size = std::stoull(args[i].substr(12));
+      } catch (const std::exception &) {
+        std::cerr << "Invalid value for --tape-size\n";
+        return false;
+      }
+    } else if (args[i].compare(0, 7, "--emit=") == 0) {
+      emit = args[i].substr(7);
+      if (emit != "asm" && emit != "obj" && emit != "exe") {
+        std::cerr << "Unknown --emit kind: " << emit << "\n";
+        return false;
+      }
+    } else if (args[i] == "-o" && i + 1 < args.size()) {
+      output_path = args[++i];
+    } else if (args[i][0] != '-') {
+      filename = args[i];
+    } else {
+      std::cerr << "Unknown option: " << args[i] << "\n";
+      return false;
+    }
+  }
+
+  if (filename.empty()) {
+    std::cerr << "Error: No input file specified.\n";
+    return false;
+  }
+
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  std::string filename;
+  uint64_t tape_size = uint64_t(1) << 30;
+  std::string emit = "asm";
+  std::string output_path;
+  if (!parseArguments(argc, argv, filename, tape_size, emit, output_path)) {
+    return 1;
+  }
+  if (output_path.empty()) {
+    output_path = emit == "asm" ? "output.s" : emit == "obj" ? "output.o"
+                                                              : "output";
+  }
+
+  std::string code;
+  std::ifstream file(filename);
+
+  if (!file) {
+    std::cerr << "Failed to open file: " << filename << '\n';
+    return 1;
+  }
+
+  std::ostringstream oss;
+  oss << file.rdbuf();
+  code = oss.str();
+
+  size_t index = 0;
+  std::vector<std::unique_ptr<Instruction>> instructions;
+  try {
+    instructions = parse(code, index);
+  } catch (const std::exception &e) {
+    std::cerr << "Error while parsing: " << e.what() << '\n';
+    return 1;
+  }
+
+  if (optimize_simple_loops || optimize_memory_scans) {
+    optimizeInstructions(instructions);
+  }
+
+  // Size the tape. Generated code only touches cells the program itself
+  // touches, and between two of them the pointer moves no further than the
+  // program has '<' and '>', which bounds how far past the tape an overrun
+  // can get before it faults.
+  const uint64_t page = 4096;
+  uint64_t moves = std::count(code.begin(), code.end(), '>') +
+                   std::count(code.begin(), code.end(), '<');
+  tape_size = (tape_size + page - 1) / page * page;
+  uint64_t margin = (moves / page + 1) * page;
+  tape_begin_offset = margin;
+  tape_end_offset = margin + tape_size;
+
+  if (emit != "asm") {
+    std::vector<uint8_t> elf;
+    try {
+      Encoder encoder;
+      std::pair<size_t, size_t> main_range =
+          encodeProgram(encoder, instructions, tape_size, margin);
+      elf = emit == "exe"
+                ? buildExecutable(encoder, main_range.first)
+                : buildObject(encoder, main_range.first, main_range.second);
+    } catch (const std::exception &e) {
+      std::cerr << "Error during code generation: " << e.what() << '\n';
+      return 1;
+    }
+    std::ofstream elf_file(output_path, std::ios::binary);
+    if (!elf_file) {
+      std::cerr << "Failed to open output file.\n";
+      return 1;
+    }
+    elf_file.write(reinterpret_cast<const char *>(elf.data()), elf.size());
+    elf_file.close();
+    if (emit == "exe") {
+      chmod(output_path.c_str(), 0755);
+    }
+    return 0;
+  }
+
+  // Generate x86-64 assembly code
+  int label_counter = 0;
+  std::ofstream output_file(output_path);
+  if (!output_file) {
+    std::cerr << "Failed to open output file.\n";
+    return 1;
+  }
+
+  output_file << "\t.text\n";
+  output_file << "\t.globl main\n";
+  output_file << "\t.type main, @function\n";
+  output_file << "main:\n";
+
+  // Save the frame pointer and the callee-saved registers used. Three
+  // pushes on top of the return address leave the stack 16-byte aligned
+  // for calls.
+  output_file << "\tpushq %rbp\n";
+  output_file << "\tmovq %rsp, %rbp\n";
+  output_file << "\tpushq %rbx\n";
+  output_file << "\tpushq %r12\n";
+
+  // Map the tape
+  emitTapeSetup(output_file, tape_size, margin);
+
+  try {
+    for (const auto &instr : instructions) {
+      instr->execute(output_file, label_counter);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "Error during code generation: " << e.what() << '\n';
+    return 1;
+  }
+
+  // Unmap the tape
+  emitTapeTeardown(output_file, tape_size, margin);
+
+  // Restore callee-saved registers and return 0 from main
+  output_file << "\tpopq %r12\n";
+  output_file << "\tpopq %rbx\n";
+  output_file << "\tpopq %rbp\n";
+  output_file << "\txorl %eax, %eax\n";
+  output_file << "\tret\n";
+  output_file << "\t.size main, .-main\n";
+
+  emitTapeRuntime(output_file);
+
+  output_file.close();
+
+  return 0;
+}
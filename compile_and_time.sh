@@ -12,31 +12,44 @@ BASE_NAME=$(basename "$INPUT_FILE" .b)
 echo "Making sure the binaries are up-to-date"
 make 
 
-# Generate Native (ARM64) assembly from the Brainf*ck source file
+# Compile the Brainf*ck source file with the native backend for this host.
+# On Linux it writes the executable itself; on macOS the ARM64 backend emits
+# assembly for clang.
 echo "Compiling $BASE_NAME to native code..."
-./bfn_arm64.o $INPUT_FILE
-clang -O3 -o ${BASE_NAME}_native.o output.s
-
-# Generate LLVM IR from the Brainf*ck source file
-echo "Generating LLVM IR from $INPUT_FILE..."
-./bfllvm.o "$INPUT_FILE" &> "$BASE_NAME.ll"
+if [ "$(uname -m)" = "x86_64" ]; then
+    ./bfn_x86_64.o --emit=exe -o "${BASE_NAME}_native.o" "$INPUT_FILE"
+elif [ "$(uname -s)" = "Linux" ]; then
+    ./bfn_arm64.o --emit=exe -o "${BASE_NAME}_native.o" "$INPUT_FILE"
+else
+    ./bfn_arm64.o -o "${BASE_NAME}_native.s" "$INPUT_FILE"
+    clang -O3 -o "${BASE_NAME}_native.o" "${BASE_NAME}_native.s"
+    rm "${BASE_NAME}_native.s"
+fi
 
-# Compile the LLVM IR to native machine code without optimizations
-echo "Compiling $BASE_NAME.ll to native code (unoptimized)..."
-clang "$BASE_NAME.ll" -o "$BASE_NAME.o"
+# Compile the Brainf*ck source file with LLVM without optimizations
+echo "Compiling $BASE_NAME to native code with LLVM (unoptimized)..."
+./bfllvm.o -O0 --emit=exe -o "$BASE_NAME.o" "$INPUT_FILE"
 
-# Compile the LLVM IR to native machine code with -O3 optimizations
-echo "Compiling $BASE_NAME.ll to native code with -O3 optimizations..."
-clang "$BASE_NAME.ll" -O3 -o "${BASE_NAME}_O3.o"
+# Compile the Brainf*ck source file with LLVM with -O3 optimizations
+echo "Compiling $BASE_NAME to native code with LLVM -O3..."
+./bfllvm.o -O3 --emit=exe -o "${BASE_NAME}_O3.o" "$INPUT_FILE"
 
 # Time the execution of the interpreter
 echo -e "\nTiming interpreter:"
 time ./bfi.o $INPUT_FILE > /dev/null
 
+# Time the baseline JIT, which includes its compile time
+echo -e "\nTiming copy-and-patch baseline JIT:"
+time ./bfi.o --baseline-jit $INPUT_FILE > /dev/null
+
 # Time the execution of the interpreter
 echo -e "\nTiming native complied code:"
 time ./${BASE_NAME}_native.o > /dev/null
 
+# Time the in-process LLVM JIT; it reports compile and run time itself
+echo -e "\nTiming LLVM JIT:"
+./bfllvm.o --jit $INPUT_FILE > /dev/null
+
 # Time the execution of the unoptimized binary
 echo -e "\nTiming unoptimized binary ($BASE_NAME.o):"
 time "./$BASE_NAME.o" > /dev/null
@@ -45,8 +58,6 @@ time "./$BASE_NAME.o" > /dev/null
 echo -e "\nTiming optimized binary (${BASE_NAME}_O3.o):"
 time "./${BASE_NAME}_O3.o" > /dev/null
 
-rm "$BASE_NAME.ll"
 rm "$BASE_NAME.o"
 rm "${BASE_NAME}_O3.o"
-rm "output.s"
 rm "${BASE_NAME}_native.o"
\ No newline at end of file